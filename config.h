@@ -71,6 +71,17 @@
  */
 #define MAX_HEAP (1024*(1<<20))  /* 1024 MB */
 
+/*
+ * Address space reserved for a heap created with MEM_RESERVE, which is
+ * committed in MEM_COMMIT_CHUNK steps as the heap grows
+ */
+#if __SIZEOF_POINTER__ == 8
+#define MAX_RESERVE ((size_t)32 << 30)    /* 32 GB */
+#else
+#define MAX_RESERVE ((size_t)2 << 30)     /* 2 GB */
+#endif
+#define MEM_COMMIT_CHUNK (2 << 20)       /* 2 MB */
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
@@ -78,5 +89,19 @@
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
 #define USE_GETTOD 0   /* gettimeofday (any Unix box) */
 #define USE_CLOCK  1   /* clock_gettime (Linux only) */
+#define USE_ROBUST 0   /* clock_gettime, adaptive repetitions, median (Linux only) */
+
+/*
+ * Parameters of the USE_ROBUST engine.  After ROBUST_WARMUP untimed
+ * runs, each run is timed separately until the 95% confidence interval
+ * of the median is narrower than ROBUST_CI_TARGET (relative half-width),
+ * with at least ROBUST_MIN_REPS and at most ROBUST_MAX_REPS samples, or
+ * until ROBUST_MAX_SECS seconds have been spent on the measurement.
+ */
+#define ROBUST_WARMUP     2
+#define ROBUST_MIN_REPS   7
+#define ROBUST_MAX_REPS 201
+#define ROBUST_CI_TARGET  0.005
+#define ROBUST_MAX_SECS   2.0
 
 #endif /* __CONFIG_H */
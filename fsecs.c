@@ -10,6 +10,9 @@
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+#if USE_ROBUST
+static struct ftimer_stats last_stats; /* details of the last measurement */
+#endif
 
 extern int verbose; /* -v option in mdriver.c */
 
@@ -42,6 +45,10 @@ void init_fsecs(void)
     clock_getres(CLOCK_MONOTONIC_RAW, &res);
     if (verbose)
 	printf("Measuring performance with clock_gettime(), advertised resolution %ldns.\n", res.tv_nsec);
+#elif USE_ROBUST
+    if (verbose)
+	printf("Measuring performance with clock_gettime(), median of up to %d runs "
+	       "to within %.1f%%.\n", ROBUST_MAX_REPS, ROBUST_CI_TARGET * 100);
 #endif
 }
 
@@ -59,7 +66,24 @@ double fsecs(fsecs_test_funct f, void *argp)
     return ftimer_gettod(f, argp, 10);
 #elif USE_CLOCK
     return ftimer_clock(f, argp, 10);
+#elif USE_ROBUST
+    return ftimer_robust(f, argp, &last_stats);
 #endif 
 }
 
+/*
+ * fsecs_last_stats - Copy out the details of the last measurement.
+ *    Returns 1 if the timing method provides them, else 0.
+ */
+int fsecs_last_stats(struct ftimer_stats *st)
+{
+#if USE_ROBUST
+    *st = last_stats;
+    return 1;
+#else
+    (void)st;
+    return 0;
+#endif
+}
+
 
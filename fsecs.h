@@ -1,4 +1,10 @@
+#include "ftimer.h"
+
 typedef void (*fsecs_test_funct)(void *);
 
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+
+/* Copy out the details of the last fsecs() measurement; returns 0 if
+   the timing method keeps none (only USE_ROBUST does) */
+int fsecs_last_stats(struct ftimer_stats *st);
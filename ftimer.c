@@ -7,11 +7,20 @@
  * Function timers that estimate the running time (in seconds) of a function f.
  *    ftimer_itimer: version that uses the interval timer
  *    ftimer_gettod: version that uses gettimeofday
+ *    ftimer_clock:  version that uses clock_gettime
+ *    ftimer_robust: clock_gettime, with warmup, adaptive repetition
+ *                   and outlier-resistant statistics
  */
+#define _GNU_SOURCE             /* for sched_getcpu */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
 #include <time.h>
 #include <sys/time.h>
 #include "ftimer.h"
+#include "config.h"
 
 /* function prototypes */
 static void init_etime(void);
@@ -136,3 +145,167 @@ double ftimer_clock(ftimer_test_funct f, void *argp, int n)
     return (1E-6*rdiff);        // in seconds
 }
 
+
+/*
+ * The robust timer.  Every run of f is timed on its own with
+ * CLOCK_MONOTONIC_RAW.  A run during which the thread moved to another
+ * CPU is thrown away and repeated.  A run during which the CPU clock
+ * changed is kept but counted, so the caller can tell that the result
+ * is suspect.  The clock is read from cpufreq in sysfs where available;
+ * otherwise a short reference loop is timed before and after each run
+ * and compared against its calibrated speed.
+ */
+#define FREQ_TOLERANCE 0.05   /* relative clock change we report */
+#define REF_LOOP_ITERS 20000  /* iterations of the reference loop */
+
+static double ref_loop_secs;  /* calibrated reference loop time, 0 if unused */
+
+static double ts_secs(struct timespec *ts)
+{
+    return ts->tv_sec + 1E-9 * ts->tv_nsec;
+}
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts_secs(&ts);
+}
+
+/* current clock of cpu in kHz from sysfs, or -1 if not available */
+static long cpu_khz(int cpu)
+{
+    char path[96];
+    long khz = -1;
+    FILE *f;
+
+    snprintf(path, sizeof path,
+             "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", cpu);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+    if (fscanf(f, "%ld", &khz) != 1)
+        khz = -1;
+    fclose(f);
+    return khz;
+}
+
+/* time a fixed amount of dependent integer work, best of three so
+   that an interrupt does not look like a clock change */
+static double ref_loop(void)
+{
+    double best = 0;
+    for (int k = 0; k < 3; k++) {
+        volatile unsigned x = 1;
+        double start = now_secs(), t;
+        for (int i = 0; i < REF_LOOP_ITERS; i++)
+            x = x * 1103515245 + 12345;
+        t = now_secs() - start;
+        if (k == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * summarize - compute median, MAD, min and the relative half-width of
+ *     the distribution-free 95% confidence interval of the median
+ *     (order statistics n/2 -/+ 0.98 sqrt(n)) of n samples
+ */
+static void summarize(double *samples, int n, struct ftimer_stats *st)
+{
+    double sorted[ROBUST_MAX_REPS], dev[ROBUST_MAX_REPS];
+    int i, lo, hi;
+
+    memcpy(sorted, samples, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), cmp_double);
+    st->samples = n;
+    st->min = sorted[0];
+    st->median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    for (i = 0; i < n; i++)
+        dev[i] = fabs(sorted[i] - st->median);
+    qsort(dev, n, sizeof(double), cmp_double);
+    st->mad = n % 2 ? dev[n / 2] : (dev[n / 2 - 1] + dev[n / 2]) / 2;
+
+    lo = (int)floor(n / 2.0 - 0.98 * sqrt(n));
+    hi = (int)ceil(n / 2.0 + 0.98 * sqrt(n));
+    if (lo < 0)
+        lo = 0;
+    if (hi > n - 1)
+        hi = n - 1;
+    st->ci = st->median > 0 ? (sorted[hi] - sorted[lo]) / (2 * st->median) : 0;
+}
+
+/*
+ * ftimer_robust - Run f(argp) ROBUST_WARMUP times untimed, then time
+ * single runs until the median is known to within ROBUST_CI_TARGET or
+ * the repetition or time budget runs out.  Return the median run time.
+ */
+double ftimer_robust(ftimer_test_funct f, void *argp, struct ftimer_stats *st)
+{
+    double samples[ROBUST_MAX_REPS];
+    struct ftimer_stats local;
+    double budget_end;
+    int n = 0, tries = 0;
+
+    if (st == NULL)
+        st = &local;
+    memset(st, 0, sizeof(*st));
+
+    /* calibrate the fallback reference loop once, if sysfs can't help */
+    if (ref_loop_secs == 0 && cpu_khz(sched_getcpu()) < 0) {
+        ref_loop_secs = ref_loop();
+        for (int i = 0; i < 10; i++) {
+            double t = ref_loop();
+            if (t < ref_loop_secs)
+                ref_loop_secs = t;
+        }
+    }
+
+    for (int i = 0; i < ROBUST_WARMUP; i++)
+        f(argp);
+
+    budget_end = now_secs() + ROBUST_MAX_SECS;
+    while (n < ROBUST_MAX_REPS && tries < 2 * ROBUST_MAX_REPS) {
+        struct timespec stv, etv;
+        int cpu_before = sched_getcpu(), cpu_after;
+        long khz_before = ref_loop_secs ? 0 : cpu_khz(cpu_before), khz_after;
+        double ref_before = ref_loop_secs ? ref_loop() : 0, ref_after;
+
+        tries++;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &stv);
+        f(argp);
+        clock_gettime(CLOCK_MONOTONIC_RAW, &etv);
+
+        cpu_after = sched_getcpu();
+        if (cpu_after != cpu_before) {
+            st->migrations++;
+            continue;
+        }
+        if (ref_loop_secs) {
+            ref_after = ref_loop();
+            if (fabs(ref_after - ref_before) > FREQ_TOLERANCE * ref_loop_secs &&
+                fabs(ref_after - ref_loop_secs) > FREQ_TOLERANCE * ref_loop_secs)
+                st->freq_changes++;
+        } else {
+            khz_after = cpu_khz(cpu_after);
+            if (labs(khz_after - khz_before) > FREQ_TOLERANCE * khz_before)
+                st->freq_changes++;
+        }
+
+        samples[n++] = ts_secs(&etv) - ts_secs(&stv);
+        if (n >= ROBUST_MIN_REPS) {
+            summarize(samples, n, st);
+            if (st->ci <= ROBUST_CI_TARGET || now_secs() > budget_end)
+                break;
+        }
+    }
+    if (n < ROBUST_MIN_REPS)   /* we kept migrating; use what we have */
+        summarize(samples, n > 0 ? n : 1, st);
+    return st->median;
+}
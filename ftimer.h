@@ -1,3 +1,6 @@
+#ifndef __FTIMER_H_
+#define __FTIMER_H_
+
 /* 
  * Function timers 
  */
@@ -15,3 +18,21 @@ double ftimer_gettod(ftimer_test_funct f, void *argp, int n);
 /* Estimate the running time of f(argp) using clock_gettime 
    Return the average of n runs */
 double ftimer_clock(ftimer_test_funct f, void *argp, int n);
+
+/* What ftimer_robust found out about one measurement */
+struct ftimer_stats {
+    int samples;        /* timed runs kept */
+    double median;      /* median run time (seconds) */
+    double mad;         /* median absolute deviation from the median */
+    double min;         /* fastest run */
+    double ci;          /* half-width of the 95% CI of the median, relative */
+    int migrations;     /* runs discarded because the thread changed CPU */
+    int freq_changes;   /* runs during which the CPU clock changed */
+};
+
+/* Estimate the running time of f(argp) using clock_gettime, repeating
+   until the median is known precisely enough; return the median and
+   fill in *st if not NULL */
+double ftimer_robust(ftimer_test_funct f, void *argp, struct ftimer_stats *st);
+
+#endif /* __FTIMER_H_ */
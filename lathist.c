@@ -0,0 +1,107 @@
+/*
+ * lathist.c - Log-linear latency histograms for per-operation timing
+ *
+ * See lathist.h.  The cycle counter is calibrated once against
+ * CLOCK_MONOTONIC_RAW so that percentiles can be reported in ns.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "lathist.h"
+
+uint64_t lat_overhead = 0;          /* ticks of an empty lat_now() pair */
+static double ticks_per_ns = 1.0;   /* cycle counter rate */
+
+static double ts_ns(struct timespec *ts)
+{
+    return ts->tv_sec * 1e9 + ts->tv_nsec;
+}
+
+/*
+ * lat_init - Measure the overhead of bracketing an operation with two
+ *     lat_now() calls, and the rate of the counter in ticks per ns.
+ */
+void lat_init(int verbose)
+{
+    struct timespec t0, t1;
+    uint64_t c0, c1, best = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < 100000; i++) {
+        uint64_t a = lat_now();
+        uint64_t b = lat_now();
+        if (b - a < best)
+            best = b - a;
+    }
+    lat_overhead = best;
+
+    /* spin for ~20ms to estimate the counter rate */
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+    c0 = lat_now();
+    do {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+    } while (ts_ns(&t1) - ts_ns(&t0) < 20e6);
+    c1 = lat_now();
+    ticks_per_ns = (c1 - c0) / (ts_ns(&t1) - ts_ns(&t0));
+    if (ticks_per_ns <= 0)
+        ticks_per_ns = 1.0;
+
+    if (verbose)
+        printf("Latency timer: %.3f ticks/ns, overhead %llu ticks calibrated out.\n",
+               ticks_per_ns, (unsigned long long)lat_overhead);
+}
+
+/*
+ * lat_clear - Empty a histogram
+ */
+void lat_clear(struct lat_hist *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+/* Midpoint of a bucket, in ticks */
+static double bucket_mid(int b)
+{
+    int shift;
+
+    if (b < 2 * LAT_SUB)
+        return b;
+    shift = b / LAT_SUB - 1;
+    return ((double)(b - shift * LAT_SUB) + 0.5) * ((uint64_t)1 << shift);
+}
+
+/* Value at quantile q (0..1) in ticks */
+static double quantile(const struct lat_hist *h, double q)
+{
+    uint64_t rank = (uint64_t)(q * h->n + 0.5);
+    uint64_t seen = 0;
+    int b;
+
+    if (rank < 1)
+        rank = 1;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen >= rank) {
+            double v = bucket_mid(b);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * lat_summarize - Summarize a histogram as percentiles in nanoseconds
+ */
+void lat_summarize(const struct lat_hist *h, struct lat_summary *s)
+{
+    s->count = h->n;
+    if (h->n == 0) {
+        s->p50 = s->p90 = s->p99 = s->p999 = s->max = 0;
+        return;
+    }
+    s->p50 = quantile(h, 0.50) / ticks_per_ns;
+    s->p90 = quantile(h, 0.90) / ticks_per_ns;
+    s->p99 = quantile(h, 0.99) / ticks_per_ns;
+    s->p999 = quantile(h, 0.999) / ticks_per_ns;
+    s->max = h->max / ticks_per_ns;
+}
@@ -0,0 +1,77 @@
+/*
+ * lathist.h - Log-linear latency histograms for per-operation timing
+ *
+ * Latencies are recorded in raw cycle-counter ticks. Values below
+ * 2*LAT_SUB are counted exactly; above that each power of two is
+ * split into LAT_SUB equal buckets, so the relative error of any
+ * reported percentile is below 1/LAT_SUB.
+ */
+#ifndef __LATHIST_H_
+#define __LATHIST_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define LAT_SUB_BITS 4
+#define LAT_SUB      (1 << LAT_SUB_BITS)      /* buckets per power of two */
+#define LAT_BUCKETS  ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+struct lat_hist {
+    uint64_t n;                     /* number of samples */
+    uint64_t max;                   /* largest sample */
+    uint64_t count[LAT_BUCKETS];
+};
+
+/* Percentiles of one histogram, in nanoseconds */
+struct lat_summary {
+    double count;
+    double p50, p90, p99, p999, max;
+};
+
+/* Read the cycle counter; this is what each sample brackets */
+static inline uint64_t lat_now(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Measured cost of an empty lat_now() pair, subtracted from samples */
+extern uint64_t lat_overhead;
+
+/* Bucket index for a value */
+static inline int lat_bucket(uint64_t v)
+{
+    if (v < 2 * LAT_SUB)
+        return (int)v;
+    int shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+    return shift * LAT_SUB + (int)(v >> shift);
+}
+
+/* Record one sample given the counter values before and after */
+static inline void lat_record(struct lat_hist *h, uint64_t start, uint64_t end)
+{
+    uint64_t v = end - start;
+    v = v > lat_overhead ? v - lat_overhead : 0;
+    h->count[lat_bucket(v)]++;
+    h->n++;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* Calibrate the timer overhead and tick rate; call once before use */
+void lat_init(int verbose);
+
+/* Empty a histogram */
+void lat_clear(struct lat_hist *h);
+
+/* Summarize a histogram as percentiles in nanoseconds */
+void lat_summarize(const struct lat_hist *h, struct lat_summary *s);
+
+#endif /* __LATHIST_H_ */
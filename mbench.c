@@ -0,0 +1,458 @@
+/*
+ * mbench.c - Microbenchmarks for the allocator's hot paths
+ *
+ * Trace replay mixes many effects together.  Each benchmark here
+ * drives one path of the allocator with a fixed, deterministic request
+ * sequence, so that a change to that path shows up on its own:
+ *
+ *   pingpong  malloc and immediately free one fixed-size block
+ *   lifo      allocate a batch of blocks, free them newest first
+ *   fifo      allocate a batch of blocks, free them oldest first
+ *   churn     replace random blocks of random size in a fixed live set
+ *   realloc   grow two interleaved blocks in small steps
+ *   coalesce  free every other block, then the rest, so that each of
+ *             the later frees merges with both neighbours
+ *   extend    allocate without freeing, so every request grows the heap
+ *   bigfree   malloc and free random sizes while 100k free blocks of
+ *             about a thousand sizes sit in the free index
+ *
+ * The binary links against one mm.c-style allocator (mbench for mm.c,
+ * mbench-gback for mm-gback-implicit.c); -l runs the same benchmarks
+ * against libc malloc instead.  Every timed run starts from a fresh
+ * heap (mem_reset_brk and mm_init, which are included in the time) and
+ * frees everything it allocated.  Times come from fsecs(), so the
+ * repetition policy is the one selected in config.h.  The default,
+ * USE_CLOCK, reports the mean of 10 runs and no CI; the numbers are only
+ * stable enough to compare commit by commit with USE_ROBUST set to 1 (and
+ * USE_CLOCK to 0), which reports the median and its CI.  Instructions and
+ * cycles per operation come from the hardware counters when available.
+ *
+ * With -o <file>, the results are also written as JSON in the layout
+ * of mdriver's results files, so mdcompare can compare two builds.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "fsecs.h"
+#include "perfctr.h"
+#include "config.h"
+
+/* Benchmark parameters */
+#define DEFAULT_OPS   100000  /* approximate operations per timed run */
+#define PING_SIZE         24  /* block size for pingpong */
+#define BATCH_BLOCKS    1000  /* blocks per batch for lifo, fifo, coalesce */
+#define BATCH_SIZE        64  /* block size for lifo and fifo */
+#define CHURN_LIVE      2000  /* live blocks in churn */
+#define REALLOC_STEP      64  /* bytes added per realloc */
+#define REALLOC_MAX    16384  /* size at which realloc starts over */
+#define RAND_ENTRIES   65536  /* pregenerated random numbers (power of 2) */
+#define BIGFREE_BLOCKS 100000  /* free blocks kept in bigfree */
+
+/* The allocator under test */
+struct allocator {
+    const char *name;
+    int (*reset)(void);             /* start over with an empty heap */
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+};
+
+/* One benchmark; run() returns the number of requests it made */
+struct bench {
+    const char *name;
+    double (*run)(void);
+    double ops;                     /* requests per run */
+    struct ftimer_stats timing;     /* from fsecs_last_stats, if any */
+    double secs;                    /* median (or best) run time */
+    struct perf_counts perf;        /* from one extra run, with -P */
+};
+
+static struct allocator *a;         /* selected at run time, so calls
+                                       cannot be optimized away */
+int verbose = 0;                    /* global flag for verbose output */
+static int nops = DEFAULT_OPS;      /* scale of each benchmark (-n) */
+static void **blocks;               /* block pointers kept by the benchmarks */
+static unsigned *rnd;               /* pregenerated random numbers */
+
+static void app_error(char *msg);
+
+/***********************************
+ * The allocators under test
+ ***********************************/
+
+static int mm_reset(void)
+{
+    mem_reset_brk();
+    return mm_init();
+}
+
+static int libc_reset(void)
+{
+    return 0;
+}
+
+static struct allocator mm_allocator = {
+    "mm", mm_reset, mm_malloc, mm_free, mm_realloc
+};
+
+static struct allocator libc_allocator = {
+    "libc", libc_reset, malloc, free, realloc
+};
+
+/* allocate a block and write to it, as a program would */
+static inline void *alloc(size_t size)
+{
+    char *p = a->malloc(size);
+    if (p == NULL)
+        app_error("mbench: malloc failed");
+    *p = (char)size;
+    return p;
+}
+
+/* random block size between 8 and about 2KB, skewed towards small */
+static inline size_t rand_size(unsigned i)
+{
+    unsigned r = rnd[i & (RAND_ENTRIES - 1)];
+    return 8 + (r >> 8) % (16u << (r & 7));
+}
+
+/***********************************
+ * The benchmarks
+ ***********************************/
+
+static double bench_pingpong(void)
+{
+    int i;
+
+    for (i = 0; i < nops / 2; i++)
+        a->free(alloc(PING_SIZE));
+    return 2.0 * i;
+}
+
+static double bench_lifo(void)
+{
+    int i, round, rounds = nops / (2 * BATCH_BLOCKS);
+
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < BATCH_BLOCKS; i++)
+            blocks[i] = alloc(BATCH_SIZE);
+        for (i = BATCH_BLOCKS - 1; i >= 0; i--)
+            a->free(blocks[i]);
+    }
+    return 2.0 * BATCH_BLOCKS * rounds;
+}
+
+static double bench_fifo(void)
+{
+    int i, round, rounds = nops / (2 * BATCH_BLOCKS);
+
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < BATCH_BLOCKS; i++)
+            blocks[i] = alloc(BATCH_SIZE);
+        for (i = 0; i < BATCH_BLOCKS; i++)
+            a->free(blocks[i]);
+    }
+    return 2.0 * BATCH_BLOCKS * rounds;
+}
+
+static double bench_churn(void)
+{
+    int i, steps = nops / 2 - CHURN_LIVE;
+
+    for (i = 0; i < CHURN_LIVE; i++)
+        blocks[i] = alloc(rand_size(i));
+    for (i = 0; i < steps; i++) {
+        unsigned slot = rnd[(i + CHURN_LIVE) & (RAND_ENTRIES - 1)] % CHURN_LIVE;
+        a->free(blocks[slot]);
+        blocks[slot] = alloc(rand_size(i + CHURN_LIVE + 1));
+    }
+    for (i = 0; i < CHURN_LIVE; i++)
+        a->free(blocks[i]);
+    return 2.0 * CHURN_LIVE + 2.0 * steps;
+}
+
+static double bench_realloc(void)
+{
+    double ops = 0;
+    size_t size;
+    int j;
+
+    while (ops < nops) {
+        blocks[0] = alloc(REALLOC_STEP);
+        blocks[1] = alloc(REALLOC_STEP);
+        for (size = 2 * REALLOC_STEP; size <= REALLOC_MAX; size += REALLOC_STEP)
+            for (j = 0; j < 2; j++)
+                if ((blocks[j] = a->realloc(blocks[j], size)) == NULL)
+                    app_error("mbench: realloc failed");
+        a->free(blocks[0]);
+        a->free(blocks[1]);
+        ops += 4 + 2 * (REALLOC_MAX / REALLOC_STEP - 1);
+    }
+    return ops;
+}
+
+static double bench_coalesce(void)
+{
+    int i, round, rounds = nops / (2 * BATCH_BLOCKS);
+
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < BATCH_BLOCKS; i++)
+            blocks[i] = alloc(rand_size(round * BATCH_BLOCKS + i));
+        for (i = 0; i < BATCH_BLOCKS; i += 2)
+            a->free(blocks[i]);
+        for (i = 1; i < BATCH_BLOCKS; i += 2)
+            a->free(blocks[i]);
+    }
+    return 2.0 * BATCH_BLOCKS * rounds;
+}
+
+static double bench_extend(void)
+{
+    int i, n = nops / 2;
+
+    for (i = 0; i < n; i++)
+        blocks[i] = alloc(rand_size(i));
+    for (i = 0; i < n; i++)
+        a->free(blocks[i]);
+    return 2.0 * n;
+}
+
+/* random block size between 8 bytes and 8KB, spread evenly */
+static inline size_t spread_size(unsigned i)
+{
+    return 8 + 8 * (rnd[i & (RAND_ENTRIES - 1)] % 1024);
+}
+
+static double bench_bigfree(void)
+{
+    int i, n = nops / 2;
+
+    /* free blocks of about a thousand sizes, kept apart by small live ones */
+    for (i = 0; i < 2 * BIGFREE_BLOCKS; i += 2) {
+        blocks[i] = alloc(spread_size(i));
+        blocks[i + 1] = alloc(8);
+    }
+    for (i = 0; i < 2 * BIGFREE_BLOCKS; i += 2)
+        a->free(blocks[i]);
+    for (i = 0; i < n; i++)
+        a->free(alloc(spread_size(i + 1)));
+    for (i = 1; i < 2 * BIGFREE_BLOCKS; i += 2)
+        a->free(blocks[i]);
+    return 4.0 * BIGFREE_BLOCKS + 2.0 * n;
+}
+
+static struct bench benches[] = {
+    { "pingpong", bench_pingpong },
+    { "lifo",     bench_lifo },
+    { "fifo",     bench_fifo },
+    { "churn",    bench_churn },
+    { "realloc",  bench_realloc },
+    { "coalesce", bench_coalesce },
+    { "extend",   bench_extend },
+    { "bigfree",  bench_bigfree },
+};
+#define NBENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+/*
+ * run_bench - one timed run of a benchmark from an empty heap
+ */
+static void run_bench(void *argp)
+{
+    struct bench *b = argp;
+
+    if (a->reset() < 0)
+        app_error("mbench: mm_init failed");
+    b->ops = b->run();
+}
+
+/*
+ * printresults - print one line per benchmark that was run
+ */
+static void printresults(int measure_perf)
+{
+    int i;
+
+    printf("%-10s %9s %9s %8s %10s %10s\n", "bench", "ops", "ns/op", "CI",
+           "instr/op", "cycles/op");
+    for (i = 0; i < NBENCHES; i++) {
+        struct bench *b = &benches[i];
+        char ci[16] = "-", instr[16] = "-", cycles[16] = "-";
+
+        if (b->ops == 0)
+            continue;
+        if (b->timing.samples > 0)
+            snprintf(ci, sizeof ci, "%.2f%%", 100 * b->timing.ci);
+        if (measure_perf && (b->perf.valid & (1u << PERF_INSTRUCTIONS)))
+            snprintf(instr, sizeof instr, "%.1f", b->perf.value[PERF_INSTRUCTIONS] / b->ops);
+        if (measure_perf && (b->perf.valid & (1u << PERF_CYCLES)))
+            snprintf(cycles, sizeof cycles, "%.1f", b->perf.value[PERF_CYCLES] / b->ops);
+        printf("%-10s %9.0f %9.2f %8s %10s %10s\n", b->name, b->ops,
+               1e9 * b->secs / b->ops, ci, instr, cycles);
+    }
+}
+
+/*
+ * printresults_as_json - write the results in the layout of mdriver's
+ *     results files; the benchmarks play the part of the traces
+ */
+static void printresults_as_json(FILE *json, int measure_perf)
+{
+    int i, first = 1;
+
+    fprintf(json, "{ \"version\": \"1.1\",\n \"allocator\": \"%s\",\n \"results\": [\n",
+            a->name);
+    for (i = 0; i < NBENCHES; i++) {
+        struct bench *b = &benches[i];
+
+        if (b->ops == 0)
+            continue;
+        fprintf(json, "%s{ \"trace\": \"%s\", \"valid\": true, \"ops\": %f, "
+                "\"secs\": %f, \"Kops\": %f, \"ns_per_op\": %f",
+                first ? "" : ", ", b->name, b->ops, b->secs,
+                (b->ops / 1e3) / b->secs, 1e9 * b->secs / b->ops);
+        if (measure_perf && (b->perf.valid & (1u << PERF_INSTRUCTIONS)))
+            fprintf(json, ", \"instr_per_op\": %f", b->perf.value[PERF_INSTRUCTIONS] / b->ops);
+        if (measure_perf && (b->perf.valid & (1u << PERF_CYCLES)))
+            fprintf(json, ", \"cycles_per_op\": %f", b->perf.value[PERF_CYCLES] / b->ops);
+        fprintf(json, " }\n");
+        first = 0;
+    }
+    fprintf(json, "]}\n");
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mbench [-hlPv] [-n <ops>] [-b <bench>] [-o <file>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b <bench> Run only this benchmark (may be repeated).\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-l         Run libc malloc instead of the linked allocator.\n");
+    fprintf(stderr, "\t-n <ops>   Requests per timed run (default %d).\n", DEFAULT_OPS);
+    fprintf(stderr, "\t-o <file>  Also write the results as JSON to <file>.\n");
+    fprintf(stderr, "\t-P         Count instructions and cycles per request.\n");
+    fprintf(stderr, "\t-v         Print the benchmarks as they run.\n");
+    fprintf(stderr, "Times are the mean of 10 runs unless mbench is built with USE_ROBUST 1\n"
+            "and USE_CLOCK 0 in config.h, which gives the median and fills the CI column.\n");
+    fprintf(stderr, "Benchmarks:");
+    for (int i = 0; i < NBENCHES; i++)
+        fprintf(stderr, " %s", benches[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    int selected[NBENCHES] = { 0 };
+    int nselected = 0, measure_perf = 0;
+    char *jsonfile = NULL;
+    int c, i;
+
+    a = &mm_allocator;
+    while ((c = getopt(argc, argv, "b:hln:o:Pv")) != EOF) {
+        switch (c) {
+        case 'b':
+            for (i = 0; i < NBENCHES; i++)
+                if (strcmp(optarg, benches[i].name) == 0)
+                    break;
+            if (i == NBENCHES) {
+                fprintf(stderr, "mbench: unknown benchmark %s\n", optarg);
+                usage();
+                exit(1);
+            }
+            selected[i] = 1;
+            nselected++;
+            break;
+        case 'l':
+            a = &libc_allocator;
+            break;
+        case 'n':
+            nops = atoi(optarg);
+            if (nops < 4 * BATCH_BLOCKS) {
+                fprintf(stderr, "mbench: -n must be at least %d\n", 4 * BATCH_BLOCKS);
+                exit(1);
+            }
+            break;
+        case 'o':
+            jsonfile = optarg;
+            break;
+        case 'P':
+            measure_perf = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    /* everything the benchmarks need is set up before timing starts */
+    if ((blocks = malloc((nops > 2 * BIGFREE_BLOCKS ? nops : 2 * BIGFREE_BLOCKS)
+                         * sizeof(void *))) == NULL ||
+        (rnd = malloc(RAND_ENTRIES * sizeof(unsigned))) == NULL)
+        app_error("mbench: out of memory");
+    unsigned x = 12345;
+    for (i = 0; i < RAND_ENTRIES; i++) {
+        x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+        rnd[i] = x;
+    }
+
+    mem_init(0);
+    init_fsecs();
+    if (measure_perf && perf_open(verbose) == 0) {
+        fprintf(stderr, "mbench: no hardware counters available, ignoring -P\n");
+        measure_perf = 0;
+    }
+
+    for (i = 0; i < NBENCHES; i++) {
+        struct bench *b = &benches[i];
+
+        if (nselected > 0 && !selected[i])
+            continue;
+        if (verbose) {
+            printf("Running %s on %s malloc\n", b->name, a->name);
+            fflush(stdout);
+        }
+        b->secs = fsecs(run_bench, b);
+        fsecs_last_stats(&b->timing);
+        if (measure_perf) {
+            if (a->reset() < 0)
+                app_error("mbench: mm_init failed");
+            perf_start();
+            b->run();
+            perf_stop(&b->perf);
+        }
+    }
+
+    printf("\nResults for %s malloc:\n", a->name);
+    printresults(measure_perf);
+
+    if (jsonfile) {
+        FILE *json = fopen(jsonfile, "w");
+        if (json == NULL) {
+            perror(jsonfile);
+            exit(1);
+        }
+        printresults_as_json(json, measure_perf);
+        fclose(json);
+    }
+
+    mem_deinit();
+    exit(0);
+}
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+static void app_error(char *msg)
+{
+    printf("%s\n", msg);
+    exit(1);
+}
@@ -0,0 +1,518 @@
+/*
+ * mdcompare.c - Compare mdriver results files and gate on regressions
+ *
+ * Reads the results.<pid>.json files written by mdriver (or by mbench
+ * -o) for a baseline and a candidate, each given as one or more files
+ * (repeated runs), and reports for every trace the change in throughput
+ * (Kops) and utilization between the medians of the two groups:
+ *
+ *   mdcompare [options] base.json cand.json
+ *   mdcompare [options] base1.json base2.json ... -- cand1.json ...
+ *
+ * With at least two runs on each side, each delta comes with a
+ * bootstrap confidence interval for the ratio of the medians and a
+ * one-sided Mann-Whitney U test for a shift in the bad direction.  A
+ * trace regresses if its median got worse by more than the threshold
+ * AND the test is significant at the chosen level, so noise on a busy
+ * machine does not trip the gate.  With a single run on either side
+ * there is nothing to test; deltas are reported but never fail.
+ *
+ * Exits with status 1 if any trace regressed, 2 on usage or input
+ * errors, and 0 otherwise.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#define MAXFILES    64  /* max runs on each side */
+#define MAXTRACES  256  /* max distinct traces */
+#define MAXDEPTH    32  /* max JSON nesting depth */
+
+/*****************************************
+ * A minimal JSON reader, enough for the
+ * files mdriver writes
+ *****************************************/
+
+struct jval {
+    enum { J_NULL, J_BOOL, J_NUM, J_STR, J_ARR, J_OBJ } type;
+    double num;            /* J_NUM, and J_BOOL as 0/1 */
+    char *str;             /* J_STR */
+    int n;                 /* number of items in J_ARR / J_OBJ */
+    char **keys;           /* J_OBJ member names */
+    struct jval **items;   /* J_ARR elements / J_OBJ member values */
+};
+
+static const char *jsrc;   /* current position in the text */
+static const char *jfile;  /* file being parsed, for errors */
+
+static void json_error(const char *msg)
+{
+    fprintf(stderr, "mdcompare: %s: %s near \"%.20s\"\n", jfile, msg, jsrc);
+    exit(2);
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "mdcompare: out of memory\n");
+        exit(2);
+    }
+    return p;
+}
+
+static void skip_ws(void)
+{
+    while (isspace((unsigned char)*jsrc))
+        jsrc++;
+}
+
+static char *parse_string(void)
+{
+    const char *start = ++jsrc;   /* skip opening quote */
+    char *s, *d;
+
+    while (*jsrc && *jsrc != '"')
+        jsrc += (*jsrc == '\\' && jsrc[1]) ? 2 : 1;
+    if (*jsrc != '"')
+        json_error("unterminated string");
+    s = d = xmalloc(jsrc - start + 1);
+    for (; start < jsrc; start++) {
+        if (*start == '\\')
+            start++;      /* keep the escaped character as is */
+        *d++ = *start;
+    }
+    *d = '\0';
+    jsrc++;
+    return s;
+}
+
+static struct jval *parse_value(int depth)
+{
+    struct jval *v = xmalloc(sizeof(*v));
+    int cap = 0;
+
+    memset(v, 0, sizeof(*v));
+    if (depth > MAXDEPTH)
+        json_error("nested too deeply");
+    skip_ws();
+    switch (*jsrc) {
+    case '{':
+    case '[':
+        v->type = *jsrc == '{' ? J_OBJ : J_ARR;
+        jsrc++;
+        skip_ws();
+        if (*jsrc == (v->type == J_OBJ ? '}' : ']')) {
+            jsrc++;
+            return v;
+        }
+        for (;;) {
+            if (v->n == cap) {
+                cap = cap ? 2 * cap : 8;
+                v->items = realloc(v->items, cap * sizeof(*v->items));
+                v->keys = realloc(v->keys, cap * sizeof(*v->keys));
+                if (v->items == NULL || v->keys == NULL)
+                    json_error("out of memory");
+            }
+            v->keys[v->n] = NULL;
+            if (v->type == J_OBJ) {
+                skip_ws();
+                if (*jsrc != '"')
+                    json_error("expected member name");
+                v->keys[v->n] = parse_string();
+                skip_ws();
+                if (*jsrc++ != ':')
+                    json_error("expected ':'");
+            }
+            v->items[v->n++] = parse_value(depth + 1);
+            skip_ws();
+            if (*jsrc == ',') {
+                jsrc++;
+                continue;
+            }
+            if (*jsrc++ != (v->type == J_OBJ ? '}' : ']'))
+                json_error("expected ',' or closing bracket");
+            return v;
+        }
+    case '"':
+        v->type = J_STR;
+        v->str = parse_string();
+        return v;
+    case 't':
+    case 'f':
+    case 'n':
+        if (strncmp(jsrc, "true", 4) == 0) {
+            v->type = J_BOOL; v->num = 1; jsrc += 4;
+        } else if (strncmp(jsrc, "false", 5) == 0) {
+            v->type = J_BOOL; v->num = 0; jsrc += 5;
+        } else if (strncmp(jsrc, "null", 4) == 0) {
+            v->type = J_NULL; jsrc += 4;
+        } else
+            json_error("unexpected literal");
+        return v;
+    default: {
+        char *end;
+        v->type = J_NUM;
+        v->num = strtod(jsrc, &end);
+        if (end == jsrc)
+            json_error("unexpected character");
+        jsrc = end;
+        return v;
+    }
+    }
+}
+
+/*
+ * json_get - return member key of object v, or NULL
+ */
+static struct jval *json_get(struct jval *v, const char *key)
+{
+    if (v == NULL || v->type != J_OBJ)
+        return NULL;
+    for (int i = 0; i < v->n; i++)
+        if (strcmp(v->keys[i], key) == 0)
+            return v->items[i];
+    return NULL;
+}
+
+/*
+ * read_json - read and parse a whole file
+ */
+static struct jval *read_json(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    struct jval *v;
+    char *text;
+    long len;
+
+    if (f == NULL) {
+        perror(path);
+        exit(2);
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    rewind(f);
+    text = xmalloc(len + 1);
+    if (fread(text, 1, len, f) != (size_t)len) {
+        perror(path);
+        exit(2);
+    }
+    text[len] = '\0';
+    fclose(f);
+
+    jfile = path;
+    jsrc = text;
+    v = parse_value(0);
+    free(text);
+    return v;
+}
+
+/*****************************************
+ * Samples and statistics
+ *****************************************/
+
+/* The runs of one trace on one side */
+struct samples {
+    int n;
+    double v[MAXFILES];
+};
+
+struct trace_samples {
+    char *name;
+    struct samples kops[2], util[2];   /* [0] baseline, [1] candidate */
+};
+
+static struct trace_samples traces[MAXTRACES];
+static int ntraces;
+
+static uint64_t rng_state = 0x6d64636f6d706172ULL;
+
+/* splitmix64, so that bootstrap intervals are reproducible */
+static uint64_t rng_next(void)
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(const double *v, int n)
+{
+    double tmp[MAXFILES];
+
+    memcpy(tmp, v, n * sizeof(double));
+    qsort(tmp, n, sizeof(double), cmp_double);
+    return n % 2 ? tmp[n / 2] : (tmp[n / 2 - 1] + tmp[n / 2]) / 2;
+}
+
+/*
+ * bootstrap_ratio - percentile bootstrap interval for the ratio of the
+ *     candidate median to the baseline median, at confidence 1-alpha
+ */
+static void bootstrap_ratio(struct samples *s, int reps, double alpha,
+                            double *lo, double *hi)
+{
+    double *ratios = xmalloc(reps * sizeof(double));
+    double r[2][MAXFILES];
+
+    for (int b = 0; b < reps; b++) {
+        for (int side = 0; side < 2; side++)
+            for (int i = 0; i < s[side].n; i++)
+                r[side][i] = s[side].v[rng_next() % s[side].n];
+        double base = median(r[0], s[0].n);
+        ratios[b] = base > 0 ? median(r[1], s[1].n) / base : 0;
+    }
+    qsort(ratios, reps, sizeof(double), cmp_double);
+    *lo = ratios[(int)(alpha / 2 * (reps - 1))];
+    *hi = ratios[(int)((1 - alpha / 2) * (reps - 1))];
+    free(ratios);
+}
+
+/*
+ * mann_whitney_less - one-sided p-value for the hypothesis that the
+ *     candidate values tend to be smaller than the baseline values.
+ *     Exact when there are no ties and the samples are small, otherwise
+ *     the normal approximation with tie and continuity correction.
+ */
+static double mann_whitney_less(struct samples *s)
+{
+    int n0 = s[0].n, n1 = s[1].n, N = n0 + n1;
+    double all[2 * MAXFILES], u = 0, ties = 0;
+    int i, j;
+
+    /* U = number of (candidate, baseline) pairs with candidate < baseline */
+    for (i = 0; i < n1; i++)
+        for (j = 0; j < n0; j++)
+            u += s[1].v[i] < s[0].v[j] ? 1 : s[1].v[i] == s[0].v[j] ? 0.5 : 0;
+
+    memcpy(all, s[0].v, n0 * sizeof(double));
+    memcpy(all + n0, s[1].v, n1 * sizeof(double));
+    qsort(all, N, sizeof(double), cmp_double);
+    for (i = 0; i < N; i = j) {
+        for (j = i + 1; j < N && all[j] == all[i]; j++)
+            ;
+        double t = j - i;
+        ties += t * t * t - t;
+    }
+
+    if (ties == 0 && N <= 40) {
+        /* F(m, n, k) = number of orderings of m baseline and n candidate
+           values in which the statistic is k.  The largest value either
+           comes from the baseline (and beats all n candidate values) or
+           from the candidate.  U is symmetric about its mean. */
+        int maxu = n0 * n1;
+        double total = 0, tail = 0;
+        double *f = calloc((size_t)(n0 + 1) * (n1 + 1) * (maxu + 1), sizeof(double));
+#define F(m, n, k) f[((size_t)(m) * (n1 + 1) + (n)) * (maxu + 1) + (k)]
+
+        if (f == NULL)
+            return 1.0;
+        for (int m = 0; m <= n0; m++)
+            for (int n = 0; n <= n1; n++)
+                for (int k = 0; k <= maxu; k++) {
+                    if (m == 0 || n == 0)
+                        F(m, n, k) = k == 0;
+                    else
+                        F(m, n, k) = (k >= n ? F(m - 1, n, k - n) : 0) + F(m, n - 1, k);
+                }
+        for (int k = 0; k <= maxu; k++) {
+            total += F(n0, n1, k);
+            if (k >= u)
+                tail += F(n0, n1, k);
+        }
+#undef F
+        free(f);
+        return tail / total;
+    }
+
+    double mean = n0 * n1 / 2.0;
+    double var = n0 * n1 / 12.0 * ((N + 1) - ties / ((double)N * (N - 1)));
+    if (var <= 0)
+        return 1.0;
+    double z = (u - mean - 0.5) / sqrt(var);
+    return 0.5 * erfc(z / sqrt(2.0));
+}
+
+/*****************************************
+ * Reading runs and comparing them
+ *****************************************/
+
+static struct trace_samples *find_trace(const char *name)
+{
+    for (int i = 0; i < ntraces; i++)
+        if (strcmp(traces[i].name, name) == 0)
+            return &traces[i];
+    if (ntraces == MAXTRACES) {
+        fprintf(stderr, "mdcompare: too many traces\n");
+        exit(2);
+    }
+    memset(&traces[ntraces], 0, sizeof(traces[ntraces]));
+    traces[ntraces].name = strdup(name);
+    return &traces[ntraces++];
+}
+
+/*
+ * add_run - add the valid traces of one results file to side 0 or 1
+ */
+static void add_run(const char *path, int side, const char *section)
+{
+    struct jval *root = read_json(path);
+    struct jval *results = json_get(root, section);
+
+    if (results == NULL || results->type != J_ARR) {
+        fprintf(stderr, "mdcompare: %s has no \"%s\" array\n", path, section);
+        exit(2);
+    }
+    for (int i = 0; i < results->n; i++) {
+        struct jval *r = results->items[i];
+        struct jval *name = json_get(r, "trace");
+        struct jval *valid = json_get(r, "valid");
+        struct jval *kops = json_get(r, "Kops");
+        struct jval *util = json_get(r, "util");
+
+        if (name == NULL || name->type != J_STR)
+            continue;       /* the trailing summary line */
+        if (valid == NULL || !valid->num || kops == NULL)
+            continue;
+        struct trace_samples *t = find_trace(name->str);
+        if (t->kops[side].n == MAXFILES)
+            continue;
+        t->kops[side].v[t->kops[side].n++] = kops->num;
+        if (util != NULL)   /* mbench results have none */
+            t->util[side].v[t->util[side].n++] = util->num;
+    }
+    /* the parse tree is small and we exit soon; it is not freed */
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mdcompare [-m] [-t <pct>] [-u <pct>] [-a <alpha>] [-b <reps>]\n"
+                    "                 <base.json> <cand.json>\n"
+                    "       mdcompare [options] <base.json>... -- <cand.json>...\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-m         Compare the multi-threaded results (mtresults).\n");
+    fprintf(stderr, "\t-t <pct>   Throughput drop that counts as a regression (default 5).\n");
+    fprintf(stderr, "\t-u <pct>   Utilization drop that counts as a regression (default 1).\n");
+    fprintf(stderr, "\t-a <alpha> Significance level of the tests (default 0.05).\n");
+    fprintf(stderr, "\t-b <reps>  Bootstrap resamples for the intervals (default 2000).\n");
+}
+
+/*
+ * compare - report one metric of one trace and return 1 if it regressed
+ */
+static int compare(const char *name, const char *metric, struct samples *s,
+                   double threshold, double alpha, int reps)
+{
+    double m0 = median(s[0].v, s[0].n), m1 = median(s[1].v, s[1].n);
+    double delta = m0 > 0 ? 100.0 * (m1 / m0 - 1) : 0;
+    int regressed = 0;
+
+    printf("%-24s %-5s %12.2f %12.2f %+8.2f%%", name, metric, m0, m1, delta);
+    if (s[0].n >= 2 && s[1].n >= 2) {
+        double lo, hi, p;
+
+        bootstrap_ratio(s, reps, alpha, &lo, &hi);
+        p = mann_whitney_less(s);
+        regressed = delta < -threshold && p <= alpha;
+        printf("  [%+7.2f%%, %+7.2f%%]  p=%.4f", 100 * (lo - 1), 100 * (hi - 1), p);
+    } else {
+        printf("  %-20s  %8s", "(single run)", "");
+    }
+    printf("%s\n", regressed ? "  REGRESSION" : "");
+    return regressed;
+}
+
+int main(int argc, char **argv)
+{
+    double kops_threshold = 5, util_threshold = 1, alpha = 0.05;
+    int reps = 2000;
+    const char *section = "results";
+    int c, i, sep = -1, nregressed = 0;
+
+    /* '+': stop at the first file name, so that "--" stays in place */
+    while ((c = getopt(argc, argv, "+mt:u:a:b:h")) != EOF) {
+        switch (c) {
+        case 'm':
+            section = "mtresults";
+            break;
+        case 't':
+            kops_threshold = atof(optarg);
+            break;
+        case 'u':
+            util_threshold = atof(optarg);
+            break;
+        case 'a':
+            alpha = atof(optarg);
+            break;
+        case 'b':
+            reps = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(2);
+        }
+    }
+    if (alpha <= 0 || alpha >= 1 || reps < 100) {
+        usage();
+        exit(2);
+    }
+
+    /* find the "--" between baseline and candidate runs, if any */
+    for (i = optind; i < argc; i++)
+        if (strcmp(argv[i], "--") == 0)
+            sep = i;
+    if (sep < 0) {
+        if (argc - optind != 2) {
+            usage();
+            exit(2);
+        }
+        add_run(argv[optind], 0, section);
+        add_run(argv[optind + 1], 1, section);
+    } else {
+        if (sep == optind || sep == argc - 1 ||
+            sep - optind > MAXFILES || argc - sep - 1 > MAXFILES) {
+            usage();
+            exit(2);
+        }
+        for (i = optind; i < sep; i++)
+            add_run(argv[i], 0, section);
+        for (i = sep + 1; i < argc; i++)
+            add_run(argv[i], 1, section);
+    }
+
+    printf("%-24s %-5s %12s %12s %9s  %-20s  %8s\n", "trace", "", "baseline",
+           "candidate", "delta", "CI", "p");
+    for (i = 0; i < ntraces; i++) {
+        struct trace_samples *t = &traces[i];
+
+        if (t->kops[0].n == 0 || t->kops[1].n == 0) {
+            printf("%-24s only valid in the %s\n", t->name,
+                   t->kops[0].n ? "baseline" : "candidate");
+            if (t->kops[0].n)
+                nregressed++;   /* a trace that stopped working */
+            continue;
+        }
+        nregressed += compare(t->name, "Kops", t->kops, kops_threshold, alpha, reps);
+        if (t->util[0].n > 0 && t->util[1].n > 0)
+            nregressed += compare(t->name, "util", t->util, util_threshold, alpha, reps);
+    }
+
+    if (nregressed) {
+        printf("%d regression%s\n", nregressed, nregressed == 1 ? "" : "s");
+        return 1;
+    }
+    return 0;
+}
@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -16,13 +17,22 @@
 #include <float.h>
 #include <time.h>
 #include <stdint.h>
+#include <sched.h>
 #include <pthread.h>
+#include <getopt.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
 #include "config.h"
+#include "tree.h"
+#include "lathist.h"
+#include "perfctr.h"
+#include "sizeclass.h"
 
 /**********************
  * Constants and macros
@@ -33,8 +43,14 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Built-in multi-threaded workloads, named as builtin:<name> traces */
+#define BUILTIN_PREFIX "builtin:"
+#define BUILTIN_BLOCKS 100000 /* blocks allocated over all threads */
+#define BUILTIN_DEPTH     256 /* blocks a thread may have in flight */
+#define BUILTIN_BATCH      32 /* blocks handed off at a time */
+
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
@@ -44,14 +60,36 @@
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    RB_ENTRY(range_t) node; /* range tree linkage, keyed by lo */
+    struct range_t *next;  /* next free record in the pool */
 } range_t;
 
+/* A block of preallocated range records */
+typedef struct range_chunk {
+    struct range_chunk *next;
+    int count;
+    range_t recs[];
+} range_chunk_t;
+
+/* 
+ * The set of currently allocated payloads. Live payloads never overlap,
+ * so a balanced tree ordered by low address is a complete interval index:
+ * a new payload can only collide with its successor or predecessor.
+ */
+typedef struct {
+    RB_HEAD(range_tree, range_t) tree;
+    range_t *free;          /* unused records */
+    range_chunk_t *chunks;  /* all records ever allocated */
+    int capacity;           /* total records in chunks */
+} range_set_t;
+
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC, HANDOFF} type; /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc/realloc request */
+    int tid;                          /* thread performing the request */
+    int seq;                          /* number of earlier requests on index */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -64,6 +102,9 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    int num_threads;     /* threads named in the trace, 0 if it has none */
+    int **thread_ops;    /* for each thread, the indices of its requests */
+    int *thread_nops;    /* ... and how many requests it has */
 } trace_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
@@ -76,6 +117,26 @@ typedef struct {
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
 
+    /* defined only when per-op latencies are measured (-L) */
+    struct lat_summary lat[3]; /* indexed by ALLOC, FREE, REALLOC */
+
+    /* defined only when hardware counters are read (-P) */
+    struct perf_counts perf;
+    struct perf_counts perf_4k;  /* same run on 4K pages, with --hugepages */
+
+    /* how the speed measurement went, if the timer says (USE_ROBUST) */
+    struct ftimer_stats timing;
+
+    /* memory the kernel held for the utilization run */
+    double heap_bytes;   /* mem_heapsize() at the end of the run */
+    double resident;     /* bytes of that heap resident in memory */
+    double minflt;       /* minor page faults taken during the run */
+    double peak_rss;     /* rise in the process's peak resident set, in KB */
+
+    /* defined only with real heap growth costs (--syscalls) */
+    double grow_calls;   /* mem_sbrk calls that grew the heap in one run */
+    double faults;       /* minor page faults taken in one run */
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
@@ -84,6 +145,16 @@ typedef struct {
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static int nthreads = 0;  /* If set to > 0, number of threads for multi-threaded testing. */
+static int vary_size = 0; /* If set, run each trace multiple times with varied sizes */
+static int measure_latency = 0; /* If set, record per-op latency histograms (-L) */
+static int measure_perf = 0;    /* If set, read hardware performance counters (-P) */
+static int telemetry_interval = 0; /* If > 0, sample heap statistics every so many ops (-T) */
+static int scale_min = 0, scale_max = 0; /* If set, sweep these thread counts (--scale) */
+static int pin_threads = 0;     /* If set, pin each replay thread to one core (--pin) */
+static int hugepages = 0;       /* MEM_HUGETLB/MEM_THP flags for the heap (--hugepages) */
+static mem_heap_t *small_page_heap; /* 4K-page heap for TLB comparisons (--hugepages -P) */
+static int syscall_heap = 0;    /* If set, heap growth pays for syscalls and faults (--syscalls) */
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -98,44 +169,80 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, 
+/* these functions manipulate range sets */
+static int add_range(range_set_t *ranges, char *lo, int size, 
                      int tracenum, int opnum);
 static __thread int check_heap_bounds;  /* if off, do not check if ranges are within heap bounds */
-static void remove_range(range_t **ranges, char *lo);
-static void clear_ranges(range_t **ranges);
+static void remove_range(range_set_t *ranges, char *lo);
+static void clear_ranges(range_set_t *ranges);
+static void reserve_ranges(range_set_t *ranges, int n);
+static void free_ranges(range_set_t *ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename, int verbose);
+static void print_size_classes(trace_t *trace);
+static trace_t *make_builtin_trace(char *name);
+static void assign_threads(trace_t *trace, int threaded);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
+static void eval_libc_trace(char *tracefile, int tracenum, stats_t *stats);
 static int eval_libc_valid(trace_t *trace, int tracenum);
 static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
+static void eval_mm_trace(char *tracefile, int tracenum, range_set_t *ranges,
+                          stats_t *stats, stats_t *mtstats);
 static int reset_heap(int tracenum);
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_valid(trace_t *trace, int tracenum, range_set_t *ranges);
+static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_set_t *ranges);
 struct single_run_args_for_valid {
     char * tracefilename;
     int tracenum;
+    int thread;                 /* which of the threads this is */
     pthread_barrier_t *go;
+    struct timespec start, end; /* when this thread's timed replay ran */
 };
 struct thread_run_result {
-    double secs;            // number of seconds used
     int heapsize;      // size to which memlib heap grew
 };
 static void * eval_mm_valid_single(void *);
-static int eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_util(trace_t *trace, int tracenum, range_set_t *ranges);
 static void eval_mm_speed(void *ptr);
 static void eval_mm_speed_inner(void *ptr);
+static void eval_mm_latency(trace_t *trace, stats_t *stats);
+static void eval_mm_perf(trace_t *trace, stats_t *stats);
+static void eval_mm_growth(trace_t *trace, stats_t *stats);
+static long minor_faults(void);
+static long reset_peak_rss(void);
+static long peak_rss(void);
+static void eval_mm_telemetry(trace_t *trace, char *tracefile);
 static void * eval_mm_speed_single(void *_args);
+static void eval_mm_threaded(trace_t *trace, int tracenum, stats_t *stats);
+static void eval_mm_private(char *tracefile, int tracenum, int num_ops, int nthr,
+                            int max_total_size, stats_t *ms);
+
+/* Routines for evaluating traces in parallel worker processes */
+static void eval_parallel(int njobs, char **tracefiles, int num_tracefiles,
+                          stats_t *libc_stats, stats_t *mm_stats, stats_t *mt_stats);
+static void pin_worker(int worker, int ncpus_per_worker);
+
+/* Routines for the thread-scaling sweep */
+static void eval_mm_scale(char *tracefile, int tracenum, range_set_t *ranges,
+                          stats_t *steps);
+static void pin_thread(int thread);
 
 /* Various helper routines */
 static void printresults(int n, char ** tracefiles, stats_t *stats);
 static void printresults_as_json(FILE *json, int n, char ** tracefiles, stats_t *stats);
+static void printlatency(int n, char ** tracefiles, stats_t *stats);
+static void printperf(int n, char ** tracefiles, stats_t *stats);
+static void printtlb(int n, char ** tracefiles, stats_t *stats);
+static void printgrowth(int n, char ** tracefiles, stats_t *stats);
+static void printmemory(int n, char ** tracefiles, stats_t *stats);
+static void printtiming(int n, char ** tracefiles, stats_t *stats);
+static void printscaling(FILE *json, int n, char ** tracefiles, stats_t *steps);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -148,41 +255,118 @@ max(int a, int b)
     return a < b ? b : a;
 }
 
+/* true if time a comes before time b */
+static int
+ts_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* seconds from start to end */
+static double
+ts_diff(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + 1E-9 * (end->tv_nsec - start->tv_nsec);
+}
+
 /**************
  * Main routine
  **************/
 int main(int argc, char **argv)
 {
     int i;
-    char c;
+    int c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
-    trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
+    range_set_t ranges = { RB_INITIALIZER(&ranges.tree) }; /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
+    stats_t *scale_stats = NULL; /* mm stats for each trace and thread count */
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
-    int nthreads = 0;    /* If set to > 0, number of threads for multi-threaded testing. */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
-    int use_mmap = 0;    /* If set, have memlib use mmap() instead malloc() */
-    int vary_size = 0;   /* If set, run each trace multiple times with varied sizes */
+    int use_mmap = 0;    /* MEM_* flags: how memlib backs the heap (-n, --reserve, ...) */
+    int njobs = 1;       /* Number of worker processes evaluating traces (-j) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput = 0, p1, p2, perfindex;
     int numcorrect;
     
+    /* long options without a one-letter equivalent */
+    enum { OPT_SCALE = 256, OPT_PIN, OPT_HUGEPAGES, OPT_RESERVE, OPT_PREFAULT,
+           OPT_SYSCALLS };
+    static const struct option long_options[] = {
+        { "scale", required_argument, NULL, OPT_SCALE },
+        { "pin",   no_argument,       NULL, OPT_PIN },
+        { "hugepages", optional_argument, NULL, OPT_HUGEPAGES },
+        { "reserve", no_argument, NULL, OPT_RESERVE },
+        { "prefault", no_argument, NULL, OPT_PREFAULT },
+        { "syscalls", no_argument, NULL, OPT_SYSCALLS },
+        { NULL, 0, NULL, 0 }
+    };
+
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "nf:t:hvVgalm:s")) != EOF) {
+    while ((c = getopt_long(argc, argv, "nf:t:hvVgalm:sj:LPT:", long_options, NULL)) != EOF) {
         switch (c) {
+        case OPT_SCALE: /* Sweep thread counts, given as N or M..N */
+            if (sscanf(optarg, "%d..%d", &scale_min, &scale_max) != 2) {
+                scale_min = 1;
+                scale_max = atoi(optarg);
+            }
+            if (scale_min < 1 || scale_max < scale_min) {
+                fprintf(stderr, "--scale requires a thread range such as 1..8\n");
+                exit(1);
+            }
+            break;
+        case OPT_PIN: /* Pin replay threads to cores */
+            pin_threads = 1;
+            break;
+        case OPT_HUGEPAGES: /* Back the heap with huge pages */
+            if (optarg == NULL || strcmp(optarg, "hugetlb") == 0)
+                hugepages = MEM_HUGETLB | MEM_THP;
+            else if (strcmp(optarg, "thp") == 0)
+                hugepages = MEM_THP;
+            else {
+                fprintf(stderr, "--hugepages takes hugetlb or thp\n");
+                exit(1);
+            }
+            break;
+        case OPT_RESERVE: /* Reserve MAX_RESERVE, commit as the heap grows */
+            use_mmap |= MEM_RESERVE;
+            break;
+        case OPT_PREFAULT: /* Touch heap memory before the heap uses it */
+            use_mmap |= MEM_PREFAULT;
+            break;
+        case OPT_SYSCALLS: /* Make each heap growth a syscall on fresh pages */
+            use_mmap |= MEM_SYSCALL;
+            syscall_heap = 1;
+            break;
+        case 'L': /* Measure per-operation latency percentiles */
+            measure_latency = 1;
+            break;
+        case 'P': /* Read hardware performance counters */
+            measure_perf = 1;
+            break;
+        case 'T': /* Record heap telemetry every so many ops */
+            telemetry_interval = atoi(optarg);
+            if (telemetry_interval < 1) {
+                fprintf(stderr, "-T requires a positive sampling interval\n");
+                exit(1);
+            }
+            break;
+        case 'j': /* Evaluate traces in parallel worker processes */
+            njobs = atoi(optarg);
+            if (njobs < 1)
+                njobs = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
         case 's':
             vary_size = 1;
             break;
         case 'n':
-            use_mmap = 1;
+            use_mmap |= MEM_MMAP;
             break;
         case 'g': /* Generate summary info for the autograder */
             autograder = 1;
@@ -264,178 +448,79 @@ int main(int argc, char **argv)
 
     /* Initialize the timing package */
     init_fsecs();
+    if (measure_latency)
+        lat_init(verbose);
+    if (measure_perf && perf_open(verbose) == 0) {
+        fprintf(stderr, "Warning: no hardware performance counters available, ignoring -P\n");
+        measure_perf = 0;
+    }
 
-    /*
-     * Optionally run and evaluate the libc malloc package 
-     */
+    /* Allocate libc stats array, with one stats_t struct per tracefile */
     if (run_libc) {
-        if (verbose > 1)
-            printf("\nTesting libc malloc\n");
-        
-        /* Allocate libc stats array, with one stats_t struct per tracefile */
         libc_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
         if (libc_stats == NULL)
             unix_error("libc_stats calloc in main failed");
-        
-        /* Evaluate the libc malloc package using the K-best scheme */
-        for (i=0; i < num_tracefiles; i++) {
-            trace = read_trace(tracedir, tracefiles[i], verbose > 1);
-            libc_stats[i].ops = trace->num_ops;
-            if (verbose > 1)
-                printf("Checking libc malloc for correctness, ");
-            libc_stats[i].valid = eval_libc_valid(trace, i);
-            if (libc_stats[i].valid) {
-                if (verbose > 1)
-                    printf("and performance.\n");
-                libc_stats[i].secs = fsecs(eval_libc_speed, trace);
-            }
-            free_trace(trace);
-        }
-
-        /* Display the libc results in a compact table */
-        if (verbose) {
-            printf("\nResults for libc malloc:\n");
-            printresults(num_tracefiles, tracefiles, libc_stats);
-        }
     }
 
-    /*
-     * Always run and evaluate the student's mm package
-     */
-    if (verbose > 1)
-        printf("\nTesting mm malloc\n");
-
     /* Allocate the mm stats array, with two stats_t struct per tracefile */
     mm_stats = (stats_t *)calloc((nthreads > 0 ? 2 : 1) * num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
-    mem_init(use_mmap); 
-
-    int max_total_size = 0;
-
-    double * size_multipliers;
-    int n_multipliers;
-    double one[] = { 1.0 };
-    double many[] = { .75, 1.0, 1.25 };
-    if (vary_size) {
-        size_multipliers = many;
-        n_multipliers = sizeof(many)/sizeof(many[0]);
-    } else {
-        size_multipliers = one;
-        n_multipliers = 1;
+    mem_init(use_mmap | hugepages); 
+    if (verbose && (use_mmap & MEM_RESERVE))
+        printf("Heap reserves %lu MB of address space, committed %s as it grows\n",
+               (unsigned long)(MAX_RESERVE >> 20),
+               use_mmap & MEM_PREFAULT ? "and prefaulted" : "on demand");
+    if (verbose && syscall_heap)
+        printf("Heap growth makes a syscall each time, on pages fresh for every run\n");
+    if (hugepages) {
+        printf("Heap backed by %s\n", mem_hugepages() == MEM_HUGETLB ? "explicit huge pages" :
+               mem_hugepages() == MEM_THP ? "transparent huge pages" : "4K pages (no huge pages)");
+        if (measure_perf &&
+            (small_page_heap = mem_heap_create(MAX_HEAP, MEM_MMAP | MEM_NOHUGE)) == NULL)
+            unix_error("could not reserve the 4K-page comparison heap");
     }
 
-    /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-        trace = read_trace(tracedir, tracefiles[i], verbose > 1);
-        mm_stats[i].ops = trace->num_ops;
-        mm_stats[i].valid = 1;
-        mm_stats[i].util = 0.0;
-        mm_stats[i].secs = 0.0;
-        for (int mi = 0; mi < n_multipliers; mi++) {
-            trace->multiplier = size_multipliers[mi];
-            if (verbose > 1 && vary_size)
-                printf("Using trace multiplier: %f\n", size_multipliers[mi]);
+    if (njobs > 1 && num_tracefiles > 1) {
+        /* Evaluate the traces concurrently, one worker process per core */
+        eval_parallel(njobs, tracefiles, num_tracefiles, libc_stats, mm_stats, 
+                      nthreads > 0 ? mm_stats + num_tracefiles : NULL);
 
-            if (verbose > 1)
-                printf("Checking mm_malloc for correctness, ");
-
-            check_heap_bounds = 1;
-            int thisrunvalid = eval_mm_valid(trace, i, &ranges);
-            if (!thisrunvalid)
-                mm_stats[i].valid = 0;
-
-            if (mm_stats[i].valid) {
-                if (verbose > 1)
-                    printf("efficiency, ");
-
-                int hwm = eval_mm_util(trace, i, &ranges);
-                if (size_multipliers[mi] == 1.0)    // record max high water mark
-                    max_total_size = hwm;
-                mm_stats[i].util += ((double)hwm / (double)mem_heapsize());
-                if (verbose > 1)
-                    printf("and performance.\n");
-                mm_stats[i].secs += fsecs(eval_mm_speed, trace);
-            }
+        if (run_libc && verbose) {
+            printf("\nResults for libc malloc:\n");
+            printresults(num_tracefiles, tracefiles, libc_stats);
         }
-        mm_stats[i].util /= n_multipliers;
-        mm_stats[i].secs /= n_multipliers;
-
-        /* Test multithreaded behavior */
-        if (nthreads) {
+    } else {
+        /*
+         * Optionally run and evaluate the libc malloc package 
+         */
+        if (run_libc) {
             if (verbose > 1)
-                printf("Checking multithreaded mm_malloc for correctness\n");
-            stats_t * ms = &mm_stats[i+num_tracefiles];
-            ms->ops = trace->num_ops * nthreads;
-
-            struct single_run_args_for_valid args[nthreads];
-            pthread_t threads[nthreads];
-            pthread_barrier_t go;
-            if (pthread_barrier_init(&go, NULL, nthreads)) {
-                perror("pthread_barrier_init");
-                abort();
-            }
-            reset_heap(i);
-
-            for (int j = 0; j < nthreads; j++) {
-                args[j].go = &go;
-                args[j].tracefilename = tracefiles[i];
-                args[j].tracenum = i;
-                if (pthread_create(threads + j, NULL, eval_mm_valid_single, args + j))
-                    perror("pthread_create"), exit(-1);
+                printf("\nTesting libc malloc\n");
+            
+            /* Evaluate the libc malloc package using the K-best scheme */
+            for (i=0; i < num_tracefiles; i++)
+                eval_libc_trace(tracefiles[i], i, &libc_stats[i]);
+
+            /* Display the libc results in a compact table */
+            if (verbose) {
+                printf("\nResults for libc malloc:\n");
+                printresults(num_tracefiles, tracefiles, libc_stats);
             }
+        }
 
-            ms->valid = 1;
-            for (int j = 0; j < nthreads; j++) {
-                uintptr_t this_run_valid;
-                if (pthread_join(threads[j], (void **)&this_run_valid))
-                    perror("pthread_join"), exit(-1);
-
-                if (!this_run_valid)
-                    ms->valid = 0;
-            }
-            if (verbose > 1)
-                printf("Result appears to be valid.\n");
+        /*
+         * Always run and evaluate the student's mm package
+         */
+        if (verbose > 1)
+            printf("\nTesting mm malloc\n");
 
-            if (!ms->valid) {
-                printf("Result is not valid, skipping further multithreads tests.\n");
-            } else {
-                // we know max_total_size, the total amount of heap memory may vary.
-                // benchmark it a few times and take the average of utilization and speed.
-                const int REPEATS = 2;
-                long heap_size_avg = 0;
-                double runtime_avg = 0.0;
-                for (int k = 0; k < REPEATS; k++) {
-                    reset_heap(i);
-
-                    for (int j = 0; j < nthreads; j++) {
-                        args[j].go = &go;
-                        args[j].tracefilename = tracefiles[i];
-                        args[j].tracenum = i;
-                        if (pthread_create(threads + j, NULL, eval_mm_speed_single, args + j))
-                            perror("pthread_create"), exit(-1);
-                    }
-
-                    for (int j = 0; j < nthreads; j++) {
-                        struct thread_run_result *r;
-                        if (pthread_join(threads[j], (void **) &r))
-                            perror("pthread_join"), exit(-1);
-                        if (r) {
-                            runtime_avg += r->secs;
-                            heap_size_avg += r->heapsize;
-                            free(r);
-                        }
-                    }
-                }
-                runtime_avg /= REPEATS;
-                heap_size_avg /= REPEATS;
-                ms->util = ((double)nthreads * max_total_size) / heap_size_avg;
-                ms->secs = runtime_avg;
-            }
-        }
-        free_trace(trace);
+        /* Evaluate student's mm malloc package using the K-best scheme */
+        for (i=0; i < num_tracefiles; i++)
+            eval_mm_trace(tracefiles[i], i, &ranges, &mm_stats[i],
+                          nthreads > 0 ? &mm_stats[i+num_tracefiles] : NULL);
     }
 
     /* Display the mm results in a compact table */
@@ -445,12 +530,71 @@ int main(int argc, char **argv)
         printf("\n");
     }
 
+    /* the timing table, if the timer kept details for any valid trace */
+    for (i=0; i < num_tracefiles; i++)
+        if (mm_stats[i].valid && mm_stats[i].timing.samples > 0)
+            break;
+    if (verbose && i < num_tracefiles) {
+        printf("\nTiming of mm malloc:\n");
+        printtiming(num_tracefiles, tracefiles, mm_stats);
+        printf("\n");
+    }
+
+    if (measure_latency) {
+        printf("\nPer-operation latency for mm malloc (ns):\n");
+        printlatency(num_tracefiles, tracefiles, mm_stats);
+        printf("\n");
+    }
+
+    if (measure_perf) {
+        printf("\nHardware counters per operation for mm malloc:\n");
+        printperf(num_tracefiles, tracefiles, mm_stats);
+        printf("\n");
+    }
+
+    if (small_page_heap) {
+        printf("\ndTLB misses per operation, 4K pages vs. huge pages:\n");
+        printtlb(num_tracefiles, tracefiles, mm_stats);
+        printf("\n");
+    }
+
+    if (verbose) {
+        printf("\nMemory held for mm malloc:\n");
+        printmemory(num_tracefiles, tracefiles, mm_stats);
+        printf("\n");
+    }
+
+    if (syscall_heap) {
+        printf("\nHeap growth per run for mm malloc:\n");
+        printgrowth(num_tracefiles, tracefiles, mm_stats);
+        printf("\n");
+    }
+
     if (nthreads && verbose) {
         printf("\nResults for multi-threaded mm malloc:\n");
         printresults(num_tracefiles, tracefiles, mm_stats+num_tracefiles);
         printf("\n");
     }
 
+    /* 
+     * Optionally sweep the thread count.  This runs after everything
+     * else, one trace at a time, so that no other work disturbs it.
+     */
+    if (scale_max > 0) {
+        int nsteps = scale_max - scale_min + 1;
+
+        scale_stats = (stats_t *)calloc(num_tracefiles * nsteps, sizeof(stats_t));
+        if (scale_stats == NULL)
+            unix_error("scale_stats calloc in main failed");
+        for (i=0; i < num_tracefiles; i++)
+            if (mm_stats[i].valid)
+                eval_mm_scale(tracefiles[i], i, &ranges, &scale_stats[i * nsteps]);
+
+        printf("\nThread scaling for mm malloc:\n");
+        printscaling(NULL, num_tracefiles, tracefiles, scale_stats);
+        printf("\n");
+    }
+
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
      */
@@ -521,6 +665,10 @@ int main(int argc, char **argv)
         fprintf(json, ", \"mtresults\": ");
         printresults_as_json(json, num_tracefiles, tracefiles, mm_stats+num_tracefiles);
     }
+    if (scale_max > 0) {
+        fprintf(json, ", \"scaling\": ");
+        printscaling(json, num_tracefiles, tracefiles, scale_stats);
+    }
     fprintf(json, "}");
     fclose(json);
 
@@ -537,151 +685,697 @@ open_jsonfile(const char * filename_mask)
 }
 
 
-/*****************************************************************
- * The following routines manipulate the range list, which keeps 
- * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
- ****************************************************************/
+/*
+ * eval_libc_trace - Check libc malloc for correctness and measure its
+ *     speed on one trace, storing the results in *stats
+ */
+static void eval_libc_trace(char *tracefile, int tracenum, stats_t *stats)
+{
+    trace_t *trace = read_trace(tracedir, tracefile, verbose > 1);
+
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+        printf("Checking libc malloc for correctness, ");
+    stats->valid = eval_libc_valid(trace, tracenum);
+    if (stats->valid) {
+        if (verbose > 1)
+            printf("and performance.\n");
+        stats->secs = fsecs(eval_libc_speed, trace);
+    }
+    free_trace(trace);
+}
 
 /*
- * add_range - As directed by request opnum in trace tracenum,
- *     we've just called the student's mm_malloc to allocate a block of 
- *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ * eval_mm_trace - Evaluate the mm malloc package on one trace for
+ *     correctness, utilization and speed, storing the results in *stats.
+ *     If mtstats is not NULL, also run the multi-threaded tests.
  */
-static int add_range(range_t **ranges, char *lo, int size, 
-                     int tracenum, int opnum)
+static void eval_mm_trace(char *tracefile, int tracenum, range_set_t *ranges,
+                          stats_t *stats, stats_t *mtstats)
 {
-    char *hi = lo + size - 1;
-    range_t *p;
-    char msg[MAXLINE];
+    trace_t *trace;
+    int max_total_size = 0;
+    int i = tracenum;
 
-    assert(size > 0);
+    double * size_multipliers;
+    int n_multipliers;
+    double one[] = { 1.0 };
+    double many[] = { .75, 1.0, 1.25 };
+    if (vary_size) {
+        size_multipliers = many;
+        n_multipliers = sizeof(many)/sizeof(many[0]);
+    } else {
+        size_multipliers = one;
+        n_multipliers = 1;
+    }
 
-    /* Payload addresses must be ALIGNMENT-byte aligned */
-    if (!IS_ALIGNED(lo)) {
-        sprintf(msg, "Payload address (%p) not aligned to %d bytes", 
-                lo, ALIGNMENT);
-        malloc_error(tracenum, opnum, msg);
-        return 0;
+    trace = read_trace(tracedir, tracefile, verbose > 1);
+    stats->ops = trace->num_ops;
+    stats->valid = 1;
+    stats->util = 0.0;
+    stats->secs = 0.0;
+    for (int mi = 0; mi < n_multipliers; mi++) {
+        trace->multiplier = size_multipliers[mi];
+        if (verbose > 1 && vary_size)
+            printf("Using trace multiplier: %f\n", size_multipliers[mi]);
+
+        if (verbose > 1)
+            printf("Checking mm_malloc for correctness, ");
+
+        check_heap_bounds = 1;
+        int thisrunvalid = eval_mm_valid(trace, i, ranges);
+        if (!thisrunvalid)
+            stats->valid = 0;
+
+        if (stats->valid) {
+            if (verbose > 1)
+                printf("efficiency, ");
+
+            /* start from an empty heap with nothing resident, so the
+               memory numbers belong to this run alone */
+            long faults, rss = -1;
+            if (size_multipliers[mi] == 1.0) {
+                mem_decommit();
+                rss = reset_peak_rss();
+            }
+            faults = minor_faults();
+            int hwm = eval_mm_util(trace, i, ranges);
+            if (size_multipliers[mi] == 1.0) {  // record max high water mark
+                long peak = peak_rss();
+
+                max_total_size = hwm;
+                stats->heap_bytes = mem_heapsize();
+                stats->resident = mem_resident();
+                stats->minflt = minor_faults() - faults;
+                stats->peak_rss = peak >= 0 && rss >= 0 ? peak - rss : -1;
+            }
+            stats->util += ((double)hwm / (double)mem_heapsize());
+            if (verbose > 1)
+                printf("and performance.\n");
+            stats->secs += fsecs(eval_mm_speed, trace);
+            if (size_multipliers[mi] == 1.0)
+                fsecs_last_stats(&stats->timing);
+        }
+    }
+    stats->util /= n_multipliers;
+    stats->secs /= n_multipliers;
+
+    /* Per-op latencies are taken in a separate run, so that reading the
+       cycle counter does not perturb the throughput measurement. */
+    if (measure_latency && stats->valid) {
+        trace->multiplier = 1.0;
+        eval_mm_latency(trace, stats);
     }
 
-    /* The payload must lie within the extent of the heap */
-    if (check_heap_bounds && (
-        (lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi()))) {
-        sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
-                lo, hi, mem_heap_lo(), mem_heap_hi());
-        malloc_error(tracenum, opnum, msg);
-        return 0;
+    /* Likewise the hardware counters, which cover one speed run */
+    if (measure_perf && stats->valid) {
+        trace->multiplier = 1.0;
+        eval_mm_perf(trace, stats);
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p->hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-            sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-                    lo, hi, p->lo, p->hi);
-            malloc_error(tracenum, opnum, msg);
-            return 0;
-        }
+    /* And the heap growth counts, which the timer cannot see */
+    if (syscall_heap && stats->valid) {
+        trace->multiplier = 1.0;
+        eval_mm_growth(trace, stats);
     }
 
-    /* 
-     * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
-     */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-        unix_error("malloc error in add_range");
-    p->next = *ranges;
-    p->lo = lo;
-    p->hi = hi;
-    *ranges = p;
-    return 1;
+    if (telemetry_interval && stats->valid) {
+        trace->multiplier = 1.0;
+        eval_mm_telemetry(trace, tracefile);
+    }
+
+    /* Test multithreaded behavior.  Traces that name threads are
+       replayed once, shared by their threads; other traces are replayed
+       by each of the -m threads on a private copy. */
+    if (mtstats && trace->num_threads > 0) {
+        if (stats->valid)
+            eval_mm_threaded(trace, i, mtstats);
+    } else if (mtstats) {
+        eval_mm_private(tracefile, i, trace->num_ops, nthreads, max_total_size, mtstats);
+    }
+    free_trace(trace);
 }
 
-/* 
- * remove_range - Free the range record of block whose payload starts at lo 
+/*
+ * eval_mm_private - Run the multi-threaded tests in which each of nthr
+ *     threads replays its own copy of the trace (of num_ops requests) on
+ *     the shared heap: check correctness, then measure speed and
+ *     utilization into *ms.
  */
-static void remove_range(range_t **ranges, char *lo)
+static void eval_mm_private(char *tracefile, int tracenum, int num_ops, int nthr,
+                            int max_total_size, stats_t *ms)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
+    if (verbose > 1)
+        printf("Checking multithreaded mm_malloc for correctness\n");
+    ms->ops = (double)num_ops * nthr;
+
+    struct single_run_args_for_valid args[nthr];
+    pthread_t threads[nthr];
+    pthread_barrier_t go;
+    if (pthread_barrier_init(&go, NULL, nthr)) {
+        perror("pthread_barrier_init");
+        abort();
+    }
+    reset_heap(tracenum);
+
+    for (int j = 0; j < nthr; j++) {
+        args[j].go = &go;
+        args[j].tracefilename = tracefile;
+        args[j].tracenum = tracenum;
+        args[j].thread = j;
+        if (pthread_create(threads + j, NULL, eval_mm_valid_single, args + j))
+            perror("pthread_create"), exit(-1);
+    }
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-            *prevpp = p->next;
-            free(p);
-            break;
+    ms->valid = 1;
+    for (int j = 0; j < nthr; j++) {
+        uintptr_t this_run_valid;
+        if (pthread_join(threads[j], (void **)&this_run_valid))
+            perror("pthread_join"), exit(-1);
+
+        if (!this_run_valid)
+            ms->valid = 0;
+    }
+    if (verbose > 1)
+        printf("Result appears to be valid.\n");
+
+    if (!ms->valid) {
+        printf("Result is not valid, skipping further multithreads tests.\n");
+    } else {
+        // we know max_total_size, the total amount of heap memory may vary.
+        // benchmark it a few times and take the average of utilization and speed.
+        const int REPEATS = 2;
+        long heap_size_avg = 0;
+        double runtime_avg = 0.0;
+        for (int k = 0; k < REPEATS; k++) {
+            reset_heap(tracenum);
+
+            for (int j = 0; j < nthr; j++) {
+                args[j].go = &go;
+                args[j].tracefilename = tracefile;
+                args[j].tracenum = tracenum;
+                args[j].thread = j;
+                if (pthread_create(threads + j, NULL, eval_mm_speed_single, args + j))
+                    perror("pthread_create"), exit(-1);
+            }
+
+            for (int j = 0; j < nthr; j++) {
+                struct thread_run_result *r;
+                if (pthread_join(threads[j], (void **) &r))
+                    perror("pthread_join"), exit(-1);
+                if (r) {
+                    heap_size_avg += r->heapsize;
+                    free(r);
+                }
+            }
+
+            /* the run lasts from the first thread's start to the last one's end */
+            struct timespec start = args[0].start, end = args[0].end;
+            for (int j = 1; j < nthr; j++) {
+                if (ts_before(&args[j].start, &start))
+                    start = args[j].start;
+                if (ts_before(&end, &args[j].end))
+                    end = args[j].end;
+            }
+            runtime_avg += ts_diff(&start, &end);
         }
-        prevpp = &(p->next);
+        runtime_avg /= REPEATS;
+        heap_size_avg /= REPEATS;
+        ms->util = ((double)nthr * max_total_size) / heap_size_avg;
+        ms->secs = runtime_avg;
     }
+    pthread_barrier_destroy(&go);
 }
 
+/*****************************************************************
+ * The following routines run the thread-scaling sweep (--scale).
+ * Each step runs the multi-threaded tests with a different number
+ * of threads; the results are kept in one stats_t per step.
+ ****************************************************************/
+
 /*
- * clear_ranges - free all of the range records for a trace 
+ * pin_thread - Pin the calling thread to the thread'th CPU (modulo the
+ *     number of CPUs) this process may run on
  */
-static void clear_ranges(range_t **ranges)
+static void pin_thread(int thread)
 {
-    range_t *p;
-    range_t *pnext;
-
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    cpu_set_t allowed, mine;
+    int cpu, n = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
+    thread %= CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || n++ != thread)
+            continue;
+        CPU_ZERO(&mine);
+        CPU_SET(cpu, &mine);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine) && verbose > 1)
+            fprintf(stderr, "pthread_setaffinity_np failed\n");
+        return;
     }
-    *ranges = NULL;
 }
 
-
-/**********************************************
- * The following routines manipulate tracefiles
- *********************************************/
-
 /*
- * read_trace - read a trace file and store it in memory
+ * eval_mm_scale - Run the multi-threaded tests on one trace for each
+ *     thread count from scale_min to scale_max, storing the results in
+ *     steps[0..scale_max-scale_min].  Built-in workloads are generated
+ *     anew for each count (they need at least 2 threads); traces that
+ *     name their own threads cannot be rescaled and are skipped.
  */
-static trace_t *read_trace(char *tracedir, char *filename, int verbose)
+static void eval_mm_scale(char *tracefile, int tracenum, range_set_t *ranges,
+                          stats_t *steps)
 {
-    char msg[MAXLINE];
-    FILE *tracefile;
-    trace_t *trace;
-    char type[MAXLINE];
-    char path[MAXLINE];
-    unsigned index, size;
-    unsigned max_index = 0;
-    unsigned op_index;
+    trace_t *trace = read_trace(tracedir, tracefile, 0);
+    int builtin = strncmp(tracefile, BUILTIN_PREFIX, strlen(BUILTIN_PREFIX)) == 0;
+    int saved_nthreads = nthreads;
+    int t, max_total_size, num_ops = trace->num_ops;
 
-    if (verbose)
-        printf("Reading tracefile: %s\n", filename);
+    if (trace->num_threads > 0 && !builtin) {
+        printf("%s names its own threads, not scaling it\n", tracefile);
+        free_trace(trace);
+        return;
+    }
 
-    /* Allocate the trace record */
-    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
-        unix_error("malloc 1 failed in read_trance");
-        
-    trace->multiplier = 1.0;
+    /* the single-threaded peak that blowup is measured against */
+    max_total_size = eval_mm_util(trace, tracenum, ranges);
+    free_trace(trace);
 
-    /* Read the trace file header */
-    strcpy(path, tracedir);
-    strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
-        sprintf(msg, "Could not open %s in read_trace", path);
-        unix_error(msg);
+    for (t = scale_min; t <= scale_max; t++) {
+        stats_t *step = &steps[t - scale_min];
+
+        if (verbose > 1)
+            printf("Scaling %s with %d threads\n", tracefile, t);
+        if (builtin) {
+            nthreads = t;
+            trace = read_trace(tracedir, tracefile, 0);
+            if (trace->num_threads == t)
+                eval_mm_threaded(trace, tracenum, step);
+            free_trace(trace);
+        } else {
+            eval_mm_private(tracefile, tracenum, num_ops, t, max_total_size, step);
+        }
     }
-    int rc;
-    rc = fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    assert (rc == 1);
-    rc = fscanf(tracefile, "%d", &(trace->num_ids));     
-    assert (rc == 1);
-    rc = fscanf(tracefile, "%d", &(trace->num_ops));     
-    assert (rc == 1);
-    rc = fscanf(tracefile, "%d", &(trace->weight));        /* not used */
-    assert (rc == 1);
-    
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-         (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-        unix_error("malloc 2 failed in read_trace");
+    nthreads = saved_nthreads;
+}
+
+/*
+ * printscaling - prints the results of the thread-scaling sweep: for
+ *     each trace and thread count, throughput, speedup and parallel
+ *     efficiency relative to the first step that ran, and heap blowup (heap size
+ *     over the threads' combined ideal peak, i.e. the inverse of
+ *     utilization).  Prints a table to stdout, or JSON to json if not NULL.
+ */
+static void printscaling(FILE *json, int n, char ** tracefiles, stats_t *steps)
+{
+    int nsteps = scale_max - scale_min + 1;
+    int i, k, first = 1;
+
+    if (json)
+        fprintf(json, "[");
+    else
+        printf("%5s%22s%9s%6s%10s%9s%7s%8s\n", "trace", " name", "threads",
+               "valid", "Kops", "speedup", "eff", "blowup");
+
+    for (i = 0; i < n; i++) {
+        stats_t *base = &steps[i * nsteps];
+        double base_tput = 0;
+        int base_threads = 0;
+
+        for (k = 0; k < nsteps; k++) {
+            stats_t *st = &base[k];
+            int threads = scale_min + k;
+            double tput, speedup, blowup;
+
+            if (st->ops == 0)       /* not run */
+                continue;
+            tput = st->valid ? st->ops / st->secs : 0;
+            if (base_threads == 0) {
+                base_threads = threads;
+                base_tput = tput;
+            }
+            speedup = base_tput > 0 ? tput / base_tput : 0;
+            blowup = st->util > 0 ? 1.0 / st->util : 0;
+            if (json) {
+                fprintf(json, "%s{ \"trace\": \"%s\", \"threads\": %d, \"valid\": %s, "
+                        "\"Kops\": %f, \"speedup\": %f, \"efficiency\": %f, \"blowup\": %f }\n",
+                        first ? "" : ", ", tracefiles[i], threads,
+                        st->valid ? "true" : "false", tput / 1e3, speedup,
+                        speedup * base_threads / threads, blowup);
+                first = 0;
+            } else if (st->valid) {
+                printf("%2d%25s%9d%6s%10.0f%9.2f%6.0f%%%8.2f\n", i, tracefiles[i],
+                       threads, "yes", tput / 1e3, speedup,
+                       100.0 * speedup * base_threads / threads, blowup);
+            } else {
+                printf("%2d%25s%9d%6s\n", i, tracefiles[i], threads, "no");
+            }
+        }
+    }
+    if (json)
+        fprintf(json, "]\n");
+}
+
+/*****************************************************************
+ * The following routines evaluate traces concurrently in forked
+ * worker processes. Each worker has its own copy of the simulated
+ * heap and of the mm package state, claims trace numbers from a
+ * shared counter, and sends back one result record per trace.
+ ****************************************************************/
+
+/* What a worker reports for each trace it evaluated */
+struct worker_result {
+    int tracenum;
+    int errors;        /* errors found while evaluating this trace */
+    stats_t libc;
+    stats_t mm;
+    stats_t mt;
+};
+
+/*
+ * pin_worker - Bind the calling worker process to its own set of
+ *     ncpus_per_worker cores, so that workers do not disturb each
+ *     other's timing.
+ */
+static void pin_worker(int worker, int ncpus_per_worker)
+{
+    cpu_set_t allowed, mine;
+    int cpus[CPU_SETSIZE];
+    int ncpus = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed))
+            cpus[ncpus++] = cpu;
+    if (ncpus == 0)
+        return;
+
+    CPU_ZERO(&mine);
+    for (int k = 0; k < ncpus_per_worker; k++)
+        CPU_SET(cpus[(worker * ncpus_per_worker + k) % ncpus], &mine);
+    if (sched_setaffinity(0, sizeof(mine), &mine) < 0 && verbose > 1)
+        perror("sched_setaffinity");
+}
+
+/*
+ * eval_parallel - Evaluate all traces using njobs worker processes and
+ *     store the results in the stats arrays, indexed by trace number as
+ *     in the sequential case. libc_stats and mt_stats may be NULL.
+ */
+static void eval_parallel(int njobs, char **tracefiles, int num_tracefiles,
+                          stats_t *libc_stats, stats_t *mm_stats, stats_t *mt_stats)
+{
+    int *next_trace;
+    int fds[njobs];
+    pid_t pids[njobs];
+
+    cpu_set_t allowed;
+
+    if (njobs > num_tracefiles)
+        njobs = num_tracefiles;
+    if (verbose > 1)
+        printf("\nTesting with %d worker processes\n", njobs);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 &&
+        njobs * (nthreads > 0 ? nthreads : 1) > CPU_COUNT(&allowed))
+        printf("Warning: %d workers share %d cores, timings will be disturbed\n",
+               njobs, CPU_COUNT(&allowed));
+
+    next_trace = mmap(NULL, sizeof(int), PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (next_trace == MAP_FAILED)
+        unix_error("mmap failed in eval_parallel");
+    *next_trace = 0;
+
+    fflush(stdout);
+    for (int w = 0; w < njobs; w++) {
+        int pfd[2];
+
+        if (pipe(pfd) < 0)
+            unix_error("pipe failed in eval_parallel");
+        if ((pids[w] = fork()) < 0)
+            unix_error("fork failed in eval_parallel");
+
+        if (pids[w] == 0) {
+            range_set_t ranges = { RB_INITIALIZER(&ranges.tree) };
+            int i;
+
+            close(pfd[0]);
+            pin_worker(w, nthreads > 0 ? nthreads : 1);
+            while ((i = __atomic_fetch_add(next_trace, 1, __ATOMIC_RELAXED)) < num_tracefiles) {
+                struct worker_result r;
+                int errors_before = errors;
+
+                memset(&r, 0, sizeof(r));
+                r.tracenum = i;
+                if (libc_stats)
+                    eval_libc_trace(tracefiles[i], i, &r.libc);
+                eval_mm_trace(tracefiles[i], i, &ranges, &r.mm, mt_stats ? &r.mt : NULL);
+                r.errors = errors - errors_before;
+                fflush(stdout);
+                if (write(pfd[1], &r, sizeof(r)) != sizeof(r))
+                    unix_error("write failed in worker");
+            }
+            fflush(stdout);
+            _exit(0);
+        }
+        close(pfd[1]);
+        fds[w] = pfd[0];
+    }
+
+    /* Results arrive in any order; they are filed by trace number */
+    for (int w = 0; w < njobs; w++) {
+        struct worker_result r;
+        ssize_t n;
+        int status;
+
+        while ((n = read(fds[w], &r, sizeof(r))) == sizeof(r)) {
+            assert(r.tracenum >= 0 && r.tracenum < num_tracefiles);
+            errors += r.errors;
+            if (libc_stats)
+                libc_stats[r.tracenum] = r.libc;
+            mm_stats[r.tracenum] = r.mm;
+            if (mt_stats)
+                mt_stats[r.tracenum] = r.mt;
+        }
+        if (n != 0)
+            unix_error("short read from worker in eval_parallel");
+        close(fds[w]);
+        if (waitpid(pids[w], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("ERROR: worker %d died while evaluating traces\n", w);
+            exit(1);
+        }
+    }
+    munmap(next_trace, sizeof(int));
+}
+
+/*****************************************************************
+ * The following routines manipulate the range set, which keeps 
+ * track of the extent of every allocated block payload. We use the 
+ * range set to detect any overlapping allocated blocks.
+ ****************************************************************/
+
+static int range_compare(range_t *a, range_t *b)
+{
+    return a->lo < b->lo ? -1 : a->lo > b->lo;
+}
+
+RB_GENERATE_STATIC(range_tree, range_t, node, range_compare);
+
+/*
+ * reserve_ranges - Make sure at least n range records are available
+ *     so that validating a trace never calls malloc per operation.
+ */
+static void reserve_ranges(range_set_t *ranges, int n)
+{
+    range_chunk_t *c;
+    int i, count = n - ranges->capacity;
+
+    if (count <= 0)
+        return;
+    if (count < 1024)
+        count = 1024;
+    if ((c = malloc(sizeof(*c) + count * sizeof(range_t))) == NULL)
+        unix_error("malloc error in reserve_ranges");
+    c->count = count;
+    c->next = ranges->chunks;
+    ranges->chunks = c;
+    ranges->capacity += count;
+    for (i = 0; i < count; i++) {
+        c->recs[i].next = ranges->free;
+        ranges->free = &c->recs[i];
+    }
+}
+
+/*
+ * add_range - As directed by request opnum in trace tracenum,
+ *     we've just called the student's mm_malloc to allocate a block of 
+ *     size bytes at addr lo. After checking the block for correctness,
+ *     we take a range record for this block and add it to the range set. 
+ */
+static int add_range(range_set_t *ranges, char *lo, int size, 
+                     int tracenum, int opnum)
+{
+    char *hi = lo + size - 1;
+    range_t *p, key;
+    char msg[MAXLINE];
+
+    assert(size > 0);
+
+    /* Payload addresses must be ALIGNMENT-byte aligned */
+    if (!IS_ALIGNED(lo)) {
+        sprintf(msg, "Payload address (%p) not aligned to %d bytes", 
+                lo, ALIGNMENT);
+        malloc_error(tracenum, opnum, msg);
+        return 0;
+    }
+
+    /* The payload must lie within the extent of the heap */
+    if (check_heap_bounds && (
+        (lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi()))) {
+        sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
+                lo, hi, mem_heap_lo(), mem_heap_hi());
+        malloc_error(tracenum, opnum, msg);
+        return 0;
+    }
+
+    /* 
+     * The payload must not overlap any other payloads. Since the 
+     * payloads in the set are disjoint, only the first payload starting
+     * at or after lo and the last one starting before it can overlap.
+     */
+    key.lo = lo;
+    p = RB_NFIND(range_tree, &ranges->tree, &key);
+    if (p != NULL && p->lo <= hi) {
+        sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+                lo, hi, p->lo, p->hi);
+        malloc_error(tracenum, opnum, msg);
+        return 0;
+    }
+    p = p ? RB_PREV(range_tree, &ranges->tree, p) 
+          : RB_MAX(range_tree, &ranges->tree);
+    if (p != NULL && p->hi >= lo) {
+        sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+                lo, hi, p->lo, p->hi);
+        malloc_error(tracenum, opnum, msg);
+        return 0;
+    }
+
+    /* 
+     * Everything looks OK, so remember the extent of this block 
+     * by taking a range record and adding it the range set.
+     */
+    if (ranges->free == NULL)
+        reserve_ranges(ranges, 2 * ranges->capacity);
+    p = ranges->free;
+    ranges->free = p->next;
+    p->lo = lo;
+    p->hi = hi;
+    RB_INSERT(range_tree, &ranges->tree, p);
+    return 1;
+}
+
+/* 
+ * remove_range - Free the range record of block whose payload starts at lo 
+ */
+static void remove_range(range_set_t *ranges, char *lo)
+{
+    range_t *p, key;
+
+    key.lo = lo;
+    if ((p = RB_FIND(range_tree, &ranges->tree, &key)) != NULL) {
+        RB_REMOVE(range_tree, &ranges->tree, p);
+        p->next = ranges->free;
+        ranges->free = p;
+    }
+}
+
+/*
+ * clear_ranges - return all of the range records for a trace to the pool
+ */
+static void clear_ranges(range_set_t *ranges)
+{
+    range_chunk_t *c;
+    int i;
+
+    RB_INIT(&ranges->tree);
+    ranges->free = NULL;
+    for (c = ranges->chunks; c != NULL; c = c->next) {
+        for (i = 0; i < c->count; i++) {
+            c->recs[i].next = ranges->free;
+            ranges->free = &c->recs[i];
+        }
+    }
+}
+
+/*
+ * free_ranges - release the storage held by a range set
+ */
+static void free_ranges(range_set_t *ranges)
+{
+    range_chunk_t *c, *cnext;
+
+    for (c = ranges->chunks; c != NULL; c = cnext) {
+        cnext = c->next;
+        free(c);
+    }
+    memset(ranges, 0, sizeof(*ranges));
+}
+
+
+/**********************************************
+ * The following routines manipulate tracefiles
+ *********************************************/
+
+/*
+ * read_trace - read a trace file and store it in memory
+ */
+static trace_t *read_trace(char *tracedir, char *filename, int verbose)
+{
+    char msg[MAXLINE];
+    FILE *tracefile;
+    trace_t *trace;
+    char type[MAXLINE];
+    char path[MAXLINE];
+    unsigned index, size;
+    unsigned max_index = 0;
+    unsigned op_index;
+    int tid, threaded = 0;
+
+    if (verbose)
+        printf("Reading tracefile: %s\n", filename);
+
+    if (strncmp(filename, BUILTIN_PREFIX, strlen(BUILTIN_PREFIX)) == 0)
+        return make_builtin_trace(filename + strlen(BUILTIN_PREFIX));
+
+    /* Allocate the trace record */
+    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+        unix_error("malloc 1 failed in read_trance");
+        
+    trace->multiplier = 1.0;
+
+    /* Read the trace file header */
+    strcpy(path, tracedir);
+    strcat(path, filename);
+    if ((tracefile = fopen(path, "r")) == NULL) {
+        sprintf(msg, "Could not open %s in read_trace", path);
+        unix_error(msg);
+    }
+    int rc;
+    rc = fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
+    assert (rc == 1);
+    rc = fscanf(tracefile, "%d", &(trace->num_ids));     
+    assert (rc == 1);
+    rc = fscanf(tracefile, "%d", &(trace->num_ops));     
+    assert (rc == 1);
+    rc = fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+    assert (rc == 1);
+    
+    /* We'll store each request line in the trace in this array */
+    if ((trace->ops = 
+         (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+        unix_error("malloc 2 failed in read_trace");
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = 
@@ -697,6 +1391,14 @@ static trace_t *read_trace(char *tracedir, char *filename, int verbose)
     index = 0;
     op_index = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
+        /* an optional @tid suffix names the thread performing the request */
+        tid = -1;
+        if (type[1] == '@') {
+            tid = atoi(type + 2);
+            threaded = 1;
+        }
+        trace->ops[op_index].tid = tid;
+
         switch(type[0]) {
         case 'a':
             rc = fscanf(tracefile, "%u %u", &index, &size);
@@ -720,6 +1422,14 @@ static trace_t *read_trace(char *tracedir, char *filename, int verbose)
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
             break;
+        case 'h':
+            rc = fscanf(tracefile, "%u %d", &index, &tid);
+            assert (rc == 2);
+            trace->ops[op_index].type = HANDOFF;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].tid = tid;
+            threaded = 1;
+            break;
         default:
             printf("Bogus type character (%c) in tracefile %s\n", 
                    type[0], path);
@@ -731,7 +1441,180 @@ static trace_t *read_trace(char *tracedir, char *filename, int verbose)
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
-    
+
+    assign_threads(trace, threaded);
+    if (verbose)
+        print_size_classes(trace);
+    return trace;
+}
+
+/*
+ * print_size_classes - Print how many distinct size classes the
+ *     trace's malloc and realloc requests fall into, and the busiest
+ */
+static void print_size_classes(trace_t *trace)
+{
+    static unsigned long count[SC_NCLASSES];
+    int i, k, used = 0;
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < trace->num_ops; i++) {
+        size_t size = trace->ops[i].size;
+
+        if (trace->ops[i].type == ALLOC || trace->ops[i].type == REALLOC)
+            count[size <= SC_MAX ? sc_class(size) : SC_NCLASSES - 1]++;
+    }
+    for (i = 0; i < SC_NCLASSES; i++)
+        used += count[i] > 0;
+    printf("Requests fall into %d size classes; busiest:", used);
+    for (k = 0; k < 5 && k < used; k++) {
+        int top = 0;
+
+        for (i = 1; i < SC_NCLASSES; i++)
+            if (count[i] > count[top])
+                top = i;
+        printf(" %u (%lu)", sc_class_size[top], count[top]);
+        count[top] = 0;
+    }
+    printf("\n");
+}
+
+/*
+ * assign_threads - Fill in the thread and per-index sequence number of
+ *     every request.  A request without an explicit thread is performed
+ *     by the thread that currently owns its block: the allocating
+ *     thread, or the receiver of the most recent handoff.  Allocations
+ *     without a thread default to thread 0.  If the trace is threaded,
+ *     also build the per-thread request lists.
+ */
+static void assign_threads(trace_t *trace, int threaded)
+{
+    int *owner, *count, *next;
+    int i, t;
+
+    if ((owner = calloc(trace->num_ids, sizeof(int))) == NULL ||
+        (count = calloc(trace->num_ids, sizeof(int))) == NULL)
+        unix_error("calloc failed in assign_threads");
+
+    trace->num_threads = 0;
+    for (i = 0;  i < trace->num_ops;  i++) {
+        traceop_t *op = &trace->ops[i];
+
+        if (op->tid < 0)
+            op->tid = op->type == ALLOC ? 0 : owner[op->index];
+        owner[op->index] = op->tid;
+        op->seq = count[op->index]++;
+        if (op->tid >= trace->num_threads)
+            trace->num_threads = op->tid + 1;
+    }
+    free(owner);
+    free(count);
+
+    if (!threaded) {
+        trace->num_threads = 0;
+        trace->thread_ops = NULL;
+        trace->thread_nops = NULL;
+        return;
+    }
+
+    if ((trace->thread_ops = calloc(trace->num_threads, sizeof(int *))) == NULL ||
+        (trace->thread_nops = calloc(trace->num_threads, sizeof(int))) == NULL ||
+        (next = calloc(trace->num_threads, sizeof(int))) == NULL)
+        unix_error("calloc failed in assign_threads");
+    for (i = 0;  i < trace->num_ops;  i++)
+        trace->thread_nops[trace->ops[i].tid]++;
+    for (t = 0; t < trace->num_threads; t++)
+        if ((trace->thread_ops[t] = malloc(trace->thread_nops[t] * sizeof(int))) == NULL)
+            unix_error("malloc failed in assign_threads");
+    for (i = 0;  i < trace->num_ops;  i++) {
+        t = trace->ops[i].tid;
+        trace->thread_ops[t][next[t]++] = i;
+    }
+    free(next);
+}
+
+/*
+ * make_builtin_trace - Generate one of the built-in multi-threaded
+ *     workloads in memory.  The thread count is taken from -m (at
+ *     least 2).  Block indices are recycled from a fixed pool per
+ *     thread, so a thread cannot get more than BUILTIN_DEPTH blocks
+ *     ahead of the threads that free them.
+ *
+ *     prodcons: the first half of the threads allocate and fill blocks
+ *               in batches and hand each batch to one of the remaining
+ *               threads, which reads and frees them.
+ *     ring:     each thread allocates blocks and passes them around
+ *               the ring of threads; the last thread to receive a
+ *               block (its allocator's predecessor) frees it.
+ */
+static trace_t *make_builtin_trace(char *name)
+{
+    int nthr = nthreads > 1 ? nthreads : 2;
+    int producers, consumers, hops, ring, per_block, blocks_per_thread;
+    int i, k, b, t, h, index;
+    unsigned seed = 1;
+    traceop_t *op;
+    trace_t *trace;
+
+    if (strcmp(name, "prodcons") == 0) {
+        producers = nthr / 2;
+        consumers = nthr - producers;
+        hops = 1;
+        ring = 0;
+    } else if (strcmp(name, "ring") == 0) {
+        producers = nthr;
+        consumers = 0;
+        hops = nthr - 1;
+        ring = 1;
+    } else {
+        fprintf(stderr, "Unknown builtin workload %s (try prodcons or ring)\n", name);
+        exit(1);
+    }
+    per_block = 2 + hops;       /* alloc, handoffs, free */
+    blocks_per_thread = BUILTIN_BLOCKS / producers;
+
+    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+        unix_error("malloc 1 failed in make_builtin_trace");
+    trace->multiplier = 1.0;
+    trace->sugg_heapsize = 0;
+    trace->weight = 1;
+    trace->num_ids = producers * BUILTIN_DEPTH;
+    trace->num_ops = producers * blocks_per_thread * per_block;
+    if ((trace->ops = malloc(trace->num_ops * sizeof(traceop_t))) == NULL ||
+        (trace->blocks = malloc(trace->num_ids * sizeof(char *))) == NULL ||
+        (trace->block_sizes = malloc(trace->num_ids * sizeof(size_t))) == NULL)
+        unix_error("malloc 2 failed in make_builtin_trace");
+
+    op = trace->ops;
+    for (k = 0; k < blocks_per_thread; k += BUILTIN_BATCH) {
+        for (t = 0; t < producers; t++) {
+            int n = blocks_per_thread - k < BUILTIN_BATCH ? blocks_per_thread - k : BUILTIN_BATCH;
+            int first = t * BUILTIN_DEPTH + k % BUILTIN_DEPTH;
+            int dest = ring ? 0 : producers + (t + k / BUILTIN_BATCH) % consumers;
+
+            for (b = 0; b < n; b++) {
+                seed = seed * 1103515245 + 12345;
+                *op++ = (traceop_t) { .type = ALLOC, .index = first + b, .tid = t,
+                                      .size = 16 + (seed >> 16) % 1009 };
+            }
+            for (b = 0; b < n; b++) {
+                index = first + b;
+                for (h = 1; h <= hops; h++) {
+                    int to = ring ? (t + h) % nthr : dest;
+                    *op++ = (traceop_t) { .type = HANDOFF, .index = index, .tid = to };
+                }
+                *op++ = (traceop_t) { .type = FREE, .index = index, .tid = -1 };
+            }
+        }
+    }
+    assert(op - trace->ops == trace->num_ops);
+
+    assign_threads(trace, 1);
+    if (verbose > 1)
+        printf("Generated builtin workload %s: %d threads, %d ops\n",
+               name, trace->num_threads, trace->num_ops);
+    for (i = 0; i < trace->num_ids; i++)
+        trace->block_sizes[i] = 0;
     return trace;
 }
 
@@ -744,6 +1627,12 @@ void free_trace(trace_t *trace)
     free(trace->ops);         /* free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
+    if (trace->thread_ops) {  /* ... the per-thread request lists... */
+        for (int t = 0; t < trace->num_threads; t++)
+            free(trace->thread_ops[t]);
+        free(trace->thread_ops);
+        free(trace->thread_nops);
+    }
     free(trace);              /* and the trace record itself... */
 }
 
@@ -769,7 +1658,7 @@ reset_heap(int tracenum)
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
+static int eval_mm_valid(trace_t *trace, int tracenum, range_set_t *ranges)
 {
     if (!reset_heap(tracenum))
         return 0;
@@ -777,7 +1666,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     return eval_mm_valid_inner(trace, tracenum, ranges);
 }
 
-static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges)
+static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_set_t *ranges)
 {
     int i, j;
     int index;
@@ -787,8 +1676,9 @@ static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges)
     char *oldp;
     char *p;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range set */
     clear_ranges(ranges);
+    reserve_ranges(ranges, trace->num_ids);
 
     /* Interpret each operation in the trace in order */
     for (i = 0;  i < trace->num_ops;  i++) {
@@ -808,7 +1698,7 @@ static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges)
             
             /* 
              * Test the range of the new block for correctness and add it 
-             * to the range list if OK. The block must be  be aligned properly,
+             * to the range set if OK. The block must be  be aligned properly,
              * and must not overlap any currently allocated block. 
              */ 
             if (add_range(ranges, p, size, tracenum, i) == 0)
@@ -835,10 +1725,10 @@ static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges)
                 return 0;
             }
             
-            /* Remove the old region from the range list */
+            /* Remove the old region from the range set */
             remove_range(ranges, oldp);
             
-            /* Check new block for correctness and add it to range list */
+            /* Check new block for correctness and add it to range set */
             if (add_range(ranges, newp, size, tracenum, i) == 0)
                 return 0;
             
@@ -850,7 +1740,7 @@ static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges)
             oldsize = trace->block_sizes[index];
             if (size < oldsize) oldsize = size;
             for (j = 0; j < oldsize; j++) {
-              if (newp[j] != (index & 0xFF)) {
+              if ((unsigned char)newp[j] != (index & 0xFF)) {
                 malloc_error(tracenum, i, "mm_realloc did not preserve the "
                              "data from old block");
                 return 0;
@@ -865,12 +1755,15 @@ static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges)
 
         case FREE: /* mm_free */
             
-            /* Remove region from list and call student's free function */
+            /* Remove region from set and call student's free function */
             p = trace->blocks[index];
             remove_range(ranges, p);
             mm_free(p);
             break;
 
+        case HANDOFF: /* only matters when threads replay the trace */
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -886,6 +1779,9 @@ eval_mm_valid_single(void *_args)
 {
     struct single_run_args_for_valid * args = _args;
 
+    if (pin_threads)
+        pin_thread(args->thread);
+
     /* read our own copy of this trace */
     trace_t * trace = read_trace(tracedir, args->tracefilename, 0);
 
@@ -894,13 +1790,13 @@ eval_mm_valid_single(void *_args)
     if (pthread_barrier_wait(args->go) == PTHREAD_BARRIER_SERIAL_THREAD) {
         ;
     }
-    range_t *ranges = NULL;
+    range_set_t ranges = { RB_INITIALIZER(&ranges.tree) };
     check_heap_bounds = 0;
     int isvalid = eval_mm_valid_inner(trace, args->tracenum, &ranges);
     assert (sizeof(int) <= sizeof(void*));
-    clear_ranges(&ranges);
+    free_ranges(&ranges);
     free_trace(trace);
-    return (void *) isvalid;
+    return (void *)(intptr_t) isvalid;
 }
 
 /* 
@@ -915,7 +1811,7 @@ eval_mm_valid_single(void *_args)
  *   
  *   Changed to return max_total_size
  */
-static int eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static int eval_mm_util(trace_t *trace, int tracenum, range_set_t *ranges)
 {   
     int i;
     int index;
@@ -988,6 +1884,9 @@ static int eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
             
             break;
 
+        case HANDOFF:
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_util");
 
@@ -1001,20 +1900,21 @@ static void *
 eval_mm_speed_single(void *_args)
 {
     struct single_run_args_for_valid * args = _args;
-    struct timeval stv, etv;
+
+    if (pin_threads)
+        pin_thread(args->thread);
 
     /* read our own copy of this trace */
     trace_t * trace = read_trace(tracedir, args->tracefilename, 0);
 
     // we start the clock here to avoid accounting for thread startup overhead
     pthread_barrier_wait(args->go);
-    gettimeofday(&stv, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &args->start);
     eval_mm_speed_inner(trace);
-    gettimeofday(&etv,NULL);
+    clock_gettime(CLOCK_MONOTONIC, &args->end);
     free_trace(trace);
     if (pthread_barrier_wait(args->go) == PTHREAD_BARRIER_SERIAL_THREAD) {
         struct thread_run_result *r = malloc(sizeof (*r));
-        r->secs = (etv.tv_sec - stv.tv_sec) + 1E-6*(etv.tv_usec-stv.tv_usec);
         r->heapsize = mem_heapsize();
         return r;
     } else
@@ -1022,20 +1922,576 @@ eval_mm_speed_single(void *_args)
 }
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * The following routines replay a threaded trace, one whose requests
+ * name the thread that performs them.  All threads share one trace;
+ * each runs its own requests in trace order, and before touching a
+ * block waits until every earlier request on that block (in whatever
+ * thread) has completed.  The earliest outstanding request in the trace
+ * can always proceed, so the replay cannot deadlock.
  */
-static void eval_mm_speed(void *ptr)
+struct threaded_run {
+    trace_t *trace;
+    int tracenum;
+    int check;                  /* validate results (else measure speed) */
+    int *stage;                 /* requests completed on each index */
+    range_set_t ranges;         /* live payloads, when checking */
+    pthread_mutex_t lock;       /* protects ranges */
+    pthread_barrier_t go;
+    volatile int failed;        /* set by the first thread to find an error */
+    long live, peak;            /* live payload bytes, when checking */
+};
+
+struct threaded_args {
+    struct threaded_run *run;
+    int tid;
+    struct timespec start, end;
+};
+
+/*
+ * wait_turn - Wait until op is the next request due on its block.
+ *    Returns 0 if another thread failed in the meantime.
+ */
+static int wait_turn(struct threaded_run *run, traceop_t *op)
 {
-    /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (mm_init() < 0) 
-        app_error("mm_init failed in eval_mm_speed");
+    int spins = 0;
 
-    eval_mm_speed_inner(ptr);
+    while (__atomic_load_n(&run->stage[op->index], __ATOMIC_ACQUIRE) != op->seq) {
+        if (run->failed)
+            return 0;
+        if (++spins == 100) {
+            sched_yield();
+            spins = 0;
+        }
+    }
+    return 1;
 }
 
-static void eval_mm_speed_inner(void *ptr)
+/*
+ * check_payload - Check that a block still holds the fill pattern
+ *    its last writer left in it
+ */
+static int check_payload(char *p, size_t size, int index)
+{
+    for (size_t j = 0; j < size; j++)
+        if ((unsigned char)p[j] != (index & 0xFF))
+            return 0;
+    return 1;
+}
+
+/*
+ * track_live - Account for a change in live bytes and update the peak
+ */
+static void track_live(struct threaded_run *run, long delta)
+{
+    long live = __atomic_add_fetch(&run->live, delta, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&run->peak, __ATOMIC_RELAXED);
+
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&run->peak, &peak, live, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * threaded_fail - Report an error (unless msg is NULL because it was
+ *    reported already) and stop the other threads
+ */
+static void *threaded_fail(struct threaded_run *run, int opnum, char *msg)
+{
+    pthread_mutex_lock(&run->lock);
+    if (!run->failed && msg)
+        malloc_error(run->tracenum, opnum, msg);
+    run->failed = 1;
+    pthread_mutex_unlock(&run->lock);
+    return (void *)0;
+}
+
+/*
+ * eval_mm_threaded_single - Perform one thread's share of a threaded
+ *    trace.  When checking, payloads are registered in the shared range
+ *    set, filled with the index when written, and verified whenever
+ *    another thread receives or frees them.  A handoff otherwise reads
+ *    one byte per cache line, as a consumer would.
+ */
+static void *eval_mm_threaded_single(void *_args)
+{
+    struct threaded_args *args = _args;
+    struct threaded_run *run = args->run;
+    trace_t *trace = run->trace;
+    volatile char sink;
+    int k, index, size, oldsize;
+    char *p, *newp;
+
+    if (pin_threads)
+        pin_thread(args->tid);
+    pthread_barrier_wait(&run->go);
+    clock_gettime(CLOCK_MONOTONIC, &args->start);
+
+    for (k = 0; k < trace->thread_nops[args->tid]; k++) {
+        int i = trace->thread_ops[args->tid][k];
+        traceop_t *op = &trace->ops[i];
+
+        if (!wait_turn(run, op))
+            return (void *)0;
+        index = op->index;
+        size = max(0, (int)(trace->multiplier * op->size));
+
+        switch (op->type) {
+        case ALLOC:
+            if ((p = mm_malloc(size)) == NULL)
+                return threaded_fail(run, i, "mm_malloc failed.");
+            if (run->check) {
+                pthread_mutex_lock(&run->lock);
+                int ok = add_range(&run->ranges, p, size, run->tracenum, i);
+                pthread_mutex_unlock(&run->lock);
+                if (!ok)
+                    return threaded_fail(run, i, NULL);
+                memset(p, index & 0xFF, size);
+                track_live(run, size);
+            }
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
+
+        case REALLOC:
+            p = trace->blocks[index];
+            if ((newp = mm_realloc(p, size)) == NULL)
+                return threaded_fail(run, i, "mm_realloc failed.");
+            if (run->check) {
+                pthread_mutex_lock(&run->lock);
+                remove_range(&run->ranges, p);
+                int ok = add_range(&run->ranges, newp, size, run->tracenum, i);
+                pthread_mutex_unlock(&run->lock);
+                if (!ok)
+                    return threaded_fail(run, i, NULL);
+                oldsize = trace->block_sizes[index];
+                if (!check_payload(newp, size < oldsize ? size : oldsize, index))
+                    return threaded_fail(run, i, "mm_realloc did not preserve the "
+                                         "data from old block");
+                memset(newp, index & 0xFF, size);
+                track_live(run, (long)size - oldsize);
+            }
+            trace->blocks[index] = newp;
+            trace->block_sizes[index] = size;
+            break;
+
+        case HANDOFF:
+            p = trace->blocks[index];
+            if (run->check) {
+                if (!check_payload(p, trace->block_sizes[index], index))
+                    return threaded_fail(run, i, "block was corrupted before handoff");
+            } else {
+                for (size_t j = 0; j < trace->block_sizes[index]; j += 64)
+                    sink = p[j];
+            }
+            break;
+
+        case FREE:
+            p = trace->blocks[index];
+            if (run->check) {
+                if (!check_payload(p, trace->block_sizes[index], index))
+                    return threaded_fail(run, i, "block was corrupted before free");
+                pthread_mutex_lock(&run->lock);
+                remove_range(&run->ranges, p);
+                pthread_mutex_unlock(&run->lock);
+                track_live(run, -(long)trace->block_sizes[index]);
+            }
+            mm_free(p);
+            break;
+        }
+        __atomic_store_n(&run->stage[index], op->seq + 1, __ATOMIC_RELEASE);
+    }
+    (void)sink;
+
+    clock_gettime(CLOCK_MONOTONIC, &args->end);
+    return (void *)1;
+}
+
+/*
+ * threaded_replay - Replay a threaded trace once on a fresh heap.
+ *    Returns 1 if all threads finished, and the elapsed time from the
+ *    first thread starting to the last one finishing in *secs.
+ */
+static int threaded_replay(struct threaded_run *run, double *secs)
+{
+    trace_t *trace = run->trace;
+    int n = trace->num_threads;
+    struct threaded_args args[n];
+    pthread_t threads[n];
+    struct timespec start, end;
+    int t, ok = 1;
+
+    if (!reset_heap(run->tracenum))
+        return 0;
+    memset(run->stage, 0, trace->num_ids * sizeof(int));
+    run->failed = 0;
+    run->live = run->peak = 0;
+    if (run->check) {
+        clear_ranges(&run->ranges);
+        reserve_ranges(&run->ranges, trace->num_ids);
+    }
+
+    for (t = 0; t < n; t++) {
+        args[t].run = run;
+        args[t].tid = t;
+        if (pthread_create(threads + t, NULL, eval_mm_threaded_single, args + t))
+            perror("pthread_create"), exit(-1);
+    }
+    for (t = 0; t < n; t++) {
+        void *thread_ok;
+        if (pthread_join(threads[t], &thread_ok))
+            perror("pthread_join"), exit(-1);
+        if (!thread_ok)
+            ok = 0;
+    }
+    if (!ok)
+        return 0;
+
+    start = args[0].start;
+    end = args[0].end;
+    for (t = 1; t < n; t++) {
+        if (ts_before(&args[t].start, &start))
+            start = args[t].start;
+        if (ts_before(&end, &args[t].end))
+            end = args[t].end;
+    }
+    *secs = ts_diff(&start, &end);
+    return 1;
+}
+
+/*
+ * eval_mm_threaded - Check a threaded trace, then measure its throughput
+ *    and space utilization.  Utilization is the peak of live bytes seen
+ *    during the checking replay over the heap size the timed replays
+ *    ended up with, so it reflects any blowup caused by cross-thread
+ *    frees.  (Threads can run ahead of each other, so the peak is
+ *    usually well above that of a sequential replay.)
+ */
+static void eval_mm_threaded(trace_t *trace, int tracenum, stats_t *stats)
+{
+    struct threaded_run run = { .trace = trace, .tracenum = tracenum,
+                                .ranges = { RB_INITIALIZER(&run.ranges.tree) } };
+    const int REPEATS = 2;
+    double secs, runtime_avg = 0.0;
+    long heap_size_avg = 0;
+    int i, k;
+
+    if (verbose > 1)
+        printf("Checking threaded replay of mm_malloc with %d threads\n",
+               trace->num_threads);
+
+    if ((run.stage = malloc(trace->num_ids * sizeof(int))) == NULL)
+        unix_error("malloc failed in eval_mm_threaded");
+    pthread_mutex_init(&run.lock, NULL);
+    if (pthread_barrier_init(&run.go, NULL, trace->num_threads)) {
+        perror("pthread_barrier_init");
+        abort();
+    }
+
+    /* handoffs are not allocator calls */
+    stats->ops = 0;
+    for (i = 0; i < trace->num_ops; i++)
+        stats->ops += trace->ops[i].type != HANDOFF;
+
+    check_heap_bounds = 0;
+    run.check = 1;
+    stats->valid = threaded_replay(&run, &secs);
+    long peak = run.peak;
+    if (!stats->valid) {
+        printf("Result is not valid, skipping further multithreads tests.\n");
+    } else {
+        run.check = 0;
+        for (k = 0; k < REPEATS; k++) {
+            if (!threaded_replay(&run, &secs))
+                app_error("threaded replay failed in eval_mm_threaded");
+            runtime_avg += secs;
+            heap_size_avg += mem_heapsize();
+        }
+        run.peak = peak;
+        stats->secs = runtime_avg / REPEATS;
+        stats->util = (double)run.peak / (heap_size_avg / REPEATS);
+    }
+
+    pthread_barrier_destroy(&run.go);
+    pthread_mutex_destroy(&run.lock);
+    free_ranges(&run.ranges);
+    free(run.stage);
+}
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr)
+{
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+        app_error("mm_init failed in eval_mm_speed");
+
+    eval_mm_speed_inner(ptr);
+}
+
+/*
+ * eval_mm_perf - Run the speed test once more with the hardware
+ *    counters enabled around the replay (but not around mm_init).
+ *    With --hugepages, repeat it on a heap of 4K pages for comparison,
+ *    after an uncounted run that faults that heap in.
+ */
+static void eval_mm_perf(trace_t *trace, stats_t *stats)
+{
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_perf");
+
+    perf_start();
+    eval_mm_speed_inner(trace);
+    perf_stop(&stats->perf);
+
+    if (small_page_heap) {
+        mem_heap_select(small_page_heap);
+        for (int k = 0; k < 2; k++) {
+            mem_reset_brk();
+            if (mm_init() < 0)
+                app_error("mm_init failed in eval_mm_perf");
+            if (k == 1)
+                perf_start();
+            eval_mm_speed_inner(trace);
+        }
+        perf_stop(&stats->perf_4k);
+        mem_heap_select(NULL);
+    }
+}
+
+/*
+ * minor_faults - minor page faults taken so far by this thread, or by
+ *    the process where the system cannot say per thread
+ */
+static long minor_faults(void)
+{
+    struct rusage ru;
+
+#ifdef RUSAGE_THREAD
+    if (getrusage(RUSAGE_THREAD, &ru) == 0)
+        return ru.ru_minflt;
+#endif
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+        unix_error("getrusage failed in minor_faults");
+    return ru.ru_minflt;
+}
+
+/*
+ * status_kb - a size in KB from /proc/self/status, such as "VmRSS", or
+ *    -1 if /proc does not say
+ */
+static long status_kb(const char *field)
+{
+    char line[MAXLINE];
+    size_t len = strlen(field);
+    long kb = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            sscanf(line + len + 1, "%ld", &kb);
+            break;
+        }
+    fclose(f);
+    return kb;
+}
+
+/*
+ * reset_peak_rss - start measuring the peak resident set afresh, if
+ *    the kernel lets us (Linux 4.0 and later).  Returns the resident
+ *    set in KB that the peak starts from, or -1 if it could not be reset.
+ */
+static long reset_peak_rss(void)
+{
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+
+    if (f == NULL)
+        return -1;
+    if (fputs("5", f) < 0 || fclose(f) != 0)
+        return -1;
+    return status_kb("VmRSS");
+}
+
+/*
+ * peak_rss - peak resident set size of the process in KB, or -1 if
+ *    /proc does not say
+ */
+static long peak_rss(void)
+{
+    return status_kb("VmHWM");
+}
+
+/*
+ * eval_mm_growth - Run the speed test once more, counting the calls
+ *    to mem_sbrk that grew the heap and the page faults they led to.
+ *    Resetting the heap returns its pages (--syscalls), so every run
+ *    faults in the same memory afresh, as a new process would.
+ */
+static void eval_mm_growth(trace_t *trace, stats_t *stats)
+{
+    unsigned long calls;
+    long faults;
+
+    mem_reset_brk();
+    calls = mem_grow_calls();
+    faults = minor_faults();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_growth");
+    eval_mm_speed_inner(trace);
+    stats->faults = minor_faults() - faults;
+    stats->grow_calls = mem_grow_calls() - calls;
+}
+
+/*
+ * eval_mm_telemetry - Replay the trace once and, every telemetry_interval
+ *    ops and after the last op, write a line of heap statistics to
+ *    telemetry.<trace>.csv.  Free-space columns are left empty if the
+ *    allocator does not provide mm_heapstats().
+ */
+static void eval_mm_telemetry(trace_t *trace, char *tracefile)
+{
+    char filename[MAXLINE];
+    char *base = strrchr(tracefile, '/');
+    struct mm_heapstats hs;
+    size_t live = 0;
+    int i, index, size;
+    char *p;
+    FILE *csv;
+
+    snprintf(filename, sizeof filename, "telemetry.%s.csv", base ? base + 1 : tracefile);
+    if ((csv = fopen(filename, "w")) == NULL)
+        unix_error("Could not open telemetry file");
+    if (verbose)
+        printf("Writing heap telemetry for %s to %s\n", tracefile, filename);
+    fprintf(csv, "op,live_bytes,heap_bytes,util,free_bytes,free_blocks,"
+                 "largest_free,index_nodes,dup_entries,index_bytes\n");
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_telemetry");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        size = max(0, (int)(trace->multiplier * trace->ops[i].size));
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(size)) == NULL)
+                app_error("mm_malloc failed in eval_mm_telemetry");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            live += size;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+                app_error("mm_realloc failed in eval_mm_telemetry");
+            live += size - trace->block_sizes[index];
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(trace->blocks[index]);
+            live -= trace->block_sizes[index];
+            break;
+
+        case HANDOFF:
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_telemetry");
+        }
+
+        if ((i + 1) % telemetry_interval != 0 && i + 1 != trace->num_ops)
+            continue;
+
+        size_t heap = mem_heapsize();
+        fprintf(csv, "%d,%zu,%zu,%.4f", i + 1, live, heap,
+                heap ? (double)live / heap : 0.0);
+        if (mm_heapstats) {
+            mm_heapstats(&hs);
+            fprintf(csv, ",%zu,%zu,%zu,%zu,%zu,%zu\n", hs.free_bytes, hs.free_blocks,
+                    hs.largest_free, hs.index_nodes, hs.dup_entries, hs.index_bytes);
+        } else {
+            fprintf(csv, ",,,,,,\n");
+        }
+    }
+    fclose(csv);
+}
+
+/*
+ * eval_mm_latency - Replay the trace once, timing each mm_malloc, mm_free
+ *    and mm_realloc call individually, and summarize the latency
+ *    distribution of each kind of operation in stats->lat.
+ */
+static void eval_mm_latency(trace_t *trace, stats_t *stats)
+{
+    static struct lat_hist hist[3];
+    int i, index, size;
+    uint64_t start, end;
+    char *p;
+
+    for (i = 0; i < 3; i++)
+        lat_clear(&hist[i]);
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        size = max(0, (int)(trace->multiplier * trace->ops[i].size));
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            start = lat_now();
+            p = mm_malloc(size);
+            end = lat_now();
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            lat_record(&hist[ALLOC], start, end);
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = trace->blocks[index];
+            start = lat_now();
+            p = mm_realloc(p, size);
+            end = lat_now();
+            if (p == NULL)
+                app_error("mm_realloc error in eval_mm_latency");
+            lat_record(&hist[REALLOC], start, end);
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            p = trace->blocks[index];
+            start = lat_now();
+            mm_free(p);
+            end = lat_now();
+            lat_record(&hist[FREE], start, end);
+            break;
+
+        case HANDOFF:
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_latency");
+        }
+    }
+
+    for (i = 0; i < 3; i++)
+        lat_summarize(&hist[i], &stats->lat[i]);
+}
+
+static void eval_mm_speed_inner(void *ptr)
 {
     int i, index, size, newsize;
     char *p, *newp, *oldp, *block;
@@ -1069,6 +2525,9 @@ static void eval_mm_speed_inner(void *ptr)
             mm_free(block);
             break;
 
+        case HANDOFF:
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -1111,6 +2570,9 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
             free(trace->blocks[trace->ops[i].index]);
             break;
 
+        case HANDOFF:
+            break;
+
         default:
             app_error("invalid operation type  in eval_libc_valid");
         }
@@ -1156,6 +2618,9 @@ static void eval_libc_speed(void *ptr)
             block = trace->blocks[index];
             free(block);
             break;
+
+        case HANDOFF:
+            break;
         }
     }
 }
@@ -1224,6 +2689,164 @@ static void printresults(int n, char ** tracefiles, stats_t *stats)
 
 }
 
+/*
+ * printlatency - prints per-operation latency percentiles for each trace
+ */
+static void printlatency(int n, char ** tracefiles, stats_t *stats)
+{
+    static const char *opnames[3] = { "malloc", "free", "realloc" };
+    int i, t;
+
+    printf("%5s%22s%9s%9s%8s%8s%8s%8s%10s\n",
+           "trace", " name", "op", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (i=0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        for (t = 0; t < 3; t++) {
+            struct lat_summary *l = &stats[i].lat[t];
+            if (l->count == 0)
+                continue;
+            printf("%2d%25s%9s%9.0f%8.0f%8.0f%8.0f%8.0f%10.0f\n",
+                   i, tracefiles[i], opnames[t], l->count,
+                   l->p50, l->p90, l->p99, l->p999, l->max);
+        }
+    }
+}
+
+/*
+ * printtiming - prints the quality of each trace's speed measurement:
+ *     samples kept, median, spread (MAD) and minimum run time, the
+ *     relative CI half-width of the median, and how many runs were
+ *     disturbed by CPU migrations or clock changes
+ */
+static void printtiming(int n, char ** tracefiles, stats_t *stats)
+{
+    int i;
+
+    printf("%5s%22s%6s%11s%8s%11s%8s%7s%6s\n", "trace", " name", "runs",
+           "median", "MAD", "min", "CI", "migr", "freq");
+    for (i=0; i < n; i++) {
+        struct ftimer_stats *t = &stats[i].timing;
+
+        if (!stats[i].valid || t->samples == 0)
+            continue;
+        printf("%2d%25s%6d%11.6f%7.2f%%%11.6f%7.2f%%%7d%6d%s\n", i, tracefiles[i],
+               t->samples, t->median, 100 * t->mad / t->median, t->min,
+               100 * t->ci, t->migrations, t->freq_changes,
+               t->ci > ROBUST_CI_TARGET || t->freq_changes ? "  *" : "");
+    }
+    printf("* did not converge, or the CPU clock changed while timing\n");
+}
+
+/*
+ * printtlb - prints dTLB misses per operation on the 4K-page heap and
+ *     the huge-page heap, and the change between the two
+ */
+static void printtlb(int n, char ** tracefiles, stats_t *stats)
+{
+    unsigned bit = 1u << PERF_DTLB_MISSES;
+    int i;
+
+    printf("%5s%22s%12s%12s%9s\n", "trace", " name", "4K", "huge", "delta");
+    for (i=0; i < n; i++) {
+        double small, huge;
+
+        if (!stats[i].valid)
+            continue;
+        printf("%2d%25s", i, tracefiles[i]);
+        if (!(stats[i].perf.valid & bit) || !(stats[i].perf_4k.valid & bit)) {
+            printf("%12s%12s%9s\n", "-", "-", "-");
+            continue;
+        }
+        small = stats[i].perf_4k.value[PERF_DTLB_MISSES] / stats[i].ops;
+        huge = stats[i].perf.value[PERF_DTLB_MISSES] / stats[i].ops;
+        printf("%12.4f%12.4f", small, huge);
+        if (small > 0)
+            printf("%8.1f%%\n", 100 * (huge / small - 1));
+        else
+            printf("%9s\n", "-");
+    }
+}
+
+/*
+ * printmemory - prints, for the utilization run of each trace, the
+ *     heap size, how much of it was resident, the minor page faults
+ *     taken, and how far the run raised the peak resident set of the
+ *     whole process.  The heap is decommitted before the run.
+ */
+static void printmemory(int n, char ** tracefiles, stats_t *stats)
+{
+    int i;
+
+    printf("%5s%22s%10s%12s%6s%10s%10s\n", "trace", " name", "heap KB",
+           "resident KB", "%", "faults", "+peak KB");
+    for (i=0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        printf("%2d%25s%10.0f%12.0f%5.0f%%%10.0f", i, tracefiles[i],
+               stats[i].heap_bytes / 1024, stats[i].resident / 1024,
+               stats[i].heap_bytes > 0 ? 100 * stats[i].resident / stats[i].heap_bytes : 0,
+               stats[i].minflt);
+        if (stats[i].peak_rss >= 0)
+            printf("%10.0f\n", stats[i].peak_rss);
+        else
+            printf("%10s\n", "-");
+    }
+}
+
+/*
+ * printgrowth - prints the heap growth calls and page faults of one
+ *     run of each trace, in total and per thousand operations
+ */
+static void printgrowth(int n, char ** tracefiles, stats_t *stats)
+{
+    int i;
+
+    printf("%5s%22s%10s%10s%12s%12s\n", "trace", " name", "grows", "faults",
+           "grows/Kop", "faults/Kop");
+    for (i=0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        printf("%2d%25s%10.0f%10.0f%12.2f%12.2f\n", i, tracefiles[i],
+               stats[i].grow_calls, stats[i].faults,
+               1000 * stats[i].grow_calls / stats[i].ops,
+               1000 * stats[i].faults / stats[i].ops);
+    }
+}
+
+/*
+ * printperf - prints hardware counter ratios for each trace.  Counters
+ *     that could not be read are shown as "-".
+ */
+static void printperf(int n, char ** tracefiles, stats_t *stats)
+{
+    int i, e;
+
+    printf("%5s%22s%7s", "trace", " name", "IPC");
+    for (e = 0; e < PERF_NEVENTS; e++)
+        printf("%14s", perf_event_names[e]);
+    printf("\n");
+    for (i=0; i < n; i++) {
+        struct perf_counts *p = &stats[i].perf;
+        unsigned both = (1u << PERF_CYCLES) | (1u << PERF_INSTRUCTIONS);
+
+        if (!stats[i].valid)
+            continue;
+        printf("%2d%25s", i, tracefiles[i]);
+        if ((p->valid & both) == both && p->value[PERF_CYCLES] > 0)
+            printf("%7.2f", p->value[PERF_INSTRUCTIONS] / p->value[PERF_CYCLES]);
+        else
+            printf("%7s", "-");
+        for (e = 0; e < PERF_NEVENTS; e++) {
+            if (p->valid & (1u << e))
+                printf("%14.3f", p->value[e] / stats[i].ops);
+            else
+                printf("%14s", "-");
+        }
+        printf("\n");
+    }
+}
+
 static void printresults_as_json(FILE *json, int n, char **tracefiles, stats_t *stats) 
 {
     int i;
@@ -1241,6 +2864,48 @@ static void printresults_as_json(FILE *json, int n, char **tracefiles, stats_t *
             fprintf(json, ", \"%s\": %f\n", "ops", stats[i].ops);
             fprintf(json, ", \"%s\": %f\n", "secs", stats[i].secs);
             fprintf(json, ", \"%s\": %f\n", "Kops", (stats[i].ops/1e3)/stats[i].secs);
+            if (measure_latency && stats[i].lat[ALLOC].count > 0) {
+                static const char *opnames[3] = { "malloc", "free", "realloc" };
+                fprintf(json, ", \"latency_ns\": {");
+                for (int t = 0; t < 3; t++) {
+                    struct lat_summary *l = &stats[i].lat[t];
+                    fprintf(json, "%s \"%s\": { \"count\": %.0f, \"p50\": %f, \"p90\": %f, "
+                            "\"p99\": %f, \"p99.9\": %f, \"max\": %f }",
+                            t ? "," : "", opnames[t], l->count,
+                            l->p50, l->p90, l->p99, l->p999, l->max);
+                }
+                fprintf(json, " }\n");
+            }
+            if (stats[i].timing.samples > 0) {
+                struct ftimer_stats *t = &stats[i].timing;
+                fprintf(json, ", \"timing\": { \"runs\": %d, \"median\": %f, \"mad\": %f, "
+                        "\"min\": %f, \"ci\": %f, \"migrations\": %d, \"freq_changes\": %d }\n",
+                        t->samples, t->median, t->mad, t->min, t->ci,
+                        t->migrations, t->freq_changes);
+            }
+            if (measure_perf && stats[i].perf.valid) {
+                int first = 1;
+                fprintf(json, ", \"perf_per_op\": {");
+                for (int e = 0; e < PERF_NEVENTS; e++) {
+                    if (!(stats[i].perf.valid & (1u << e)))
+                        continue;
+                    fprintf(json, "%s \"%s\": %f", first ? "" : ",",
+                            perf_event_names[e], stats[i].perf.value[e] / stats[i].ops);
+                    first = 0;
+                }
+                fprintf(json, " }\n");
+            }
+            if (small_page_heap && (stats[i].perf_4k.valid & (1u << PERF_DTLB_MISSES)))
+                fprintf(json, ", \"dTLB_misses_4k_per_op\": %f\n",
+                        stats[i].perf_4k.value[PERF_DTLB_MISSES] / stats[i].ops);
+            if (stats[i].heap_bytes > 0)
+                fprintf(json, ", \"heap_bytes\": %.0f, \"resident_bytes\": %.0f, "
+                        "\"minor_faults\": %.0f, \"peak_rss_rise_kb\": %.0f\n",
+                        stats[i].heap_bytes, stats[i].resident,
+                        stats[i].minflt, stats[i].peak_rss);
+            if (syscall_heap)
+                fprintf(json, ", \"grow_calls\": %.0f, \"faults\": %.0f\n",
+                        stats[i].grow_calls, stats[i].faults);
             fprintf(json, "}");
 
             secs += stats[i].secs;
@@ -1290,17 +2955,32 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-shvVal] [-f <file>] [-m <t>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-shvValLP] [-T <n>] [-f <file>] [-j <n>] [-m <t>] [-t <dir>]\n"
+            "               [--scale <m>..<n>] [--pin] [--hugepages[=thp|hugetlb]]\n"
+            "               [--reserve] [--prefault] [--syscalls]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file, or builtin:prodcons or\n");
+    fprintf(stderr, "\t           builtin:ring for a generated cross-thread workload.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate traces in <n> pinned worker processes (0: one per core).\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Report per-operation latency percentiles.\n");
+    fprintf(stderr, "\t-P         Report hardware performance counters per operation.\n");
+    fprintf(stderr, "\t-T <n>     Write heap telemetry every <n> ops to telemetry.<trace>.csv.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
     fprintf(stderr, "\t-n         Don't randomize addresses.\n");
     fprintf(stderr, "\t-s         Vary amplitude of each trace.\n");
     fprintf(stderr, "\t-m <t>     Run with multiple threads (mdriver-ts only).\n");
+    fprintf(stderr, "\t--scale <m>..<n>  Sweep the thread count from <m> to <n> (mdriver-ts only).\n");
+    fprintf(stderr, "\t--pin      Pin each replay thread to its own core.\n");
+    fprintf(stderr, "\t--hugepages[=thp|hugetlb]  Back the heap with 2MB pages (default: hugetlb,\n"
+                    "\t           falling back to thp); with -P, compare dTLB misses with 4K pages.\n");
+    fprintf(stderr, "\t--reserve  Reserve a large heap and commit it as it grows.\n");
+    fprintf(stderr, "\t--prefault Touch heap memory as it is committed, not on first use.\n");
+    fprintf(stderr, "\t--syscalls Make each heap growth a syscall on fresh pages, and report\n"
+                    "\t           growth calls and page faults per trace.\n");
 }
@@ -2,6 +2,25 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            Each simulated heap is a mem_heap_t with its own reservation,
+ *            so several heaps can coexist in one process.  The original
+ *            mem_* functions operate on a default heap set up by
+ *            mem_init(), or on the heap the calling thread selected
+ *            with mem_heap_select().
+ *
+ *            A heap reserved with mmap can be backed by 2MB huge pages,
+ *            either explicit ones from the hugetlb pool or transparent
+ *            ones, to cut dTLB misses on large heaps.
+ *
+ *            With MEM_RESERVE, a heap is a PROT_NONE reservation that
+ *            mem_sbrk() commits (makes read-write) in MEM_COMMIT_CHUNK
+ *            steps, so a large reservation costs no memory until the
+ *            heap grows into it.  MEM_PREFAULT touches memory as it is
+ *            committed, trading a slower start for no page faults later.
+ *            MEM_SYSCALL goes further and makes every growth a real
+ *            mprotect() call on pages that are fresh after each reset,
+ *            so the cost of growing the heap is not hidden.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,91 +33,488 @@
 #include "memlib.h"
 #include "config.h"
 
+struct mem_heap {
+    char *start_brk;  /* points to first byte of heap */
+    char *brk;        /* points to last byte of heap */
+    char *max_addr;   /* largest legal heap address */
+    char *committed;  /* end of the read-write part of the reservation */
+    char *top;        /* highest break since the heap was last decommitted */
+    size_t reserved;  /* bytes reserved for this heap */
+    int use_mmap;     /* Use mmap instead of malloc (MEM_* flags) */
+    int hugepages;    /* MEM_HUGETLB or MEM_THP if we got huge pages */
+    unsigned long grow_calls; /* mem_sbrk calls that grew the heap */
+};
+
 /* private variables */
-static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */ 
-static int use_mmap;         /* Use mmap instead of malloc */
+static struct mem_heap default_heap;
+static __thread mem_heap_t *cur_heap;   /* heap selected by this thread */
 static void * mmap_addr = (void *)0x58000000;
 
-/* 
- * mem_init - initialize the memory system model
+/*
+ * map_hugetlb - try to map size bytes of explicit huge pages at addr
+ *    (if not NULL).  Returns NULL if the pool can't supply them.
  */
-void mem_init(int _use_mmap)
+static char *map_hugetlb(void *addr, size_t size)
+{
+#ifdef MAP_HUGETLB
+    char *p = mmap(addr, size, PROT_READ|PROT_WRITE,
+                   (addr ? MAP_FIXED : 0) | MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB,
+                   -1, 0);
+    if (p != MAP_FAILED)
+        return p;
+    fprintf(stderr, "mem_init_vm: no explicit huge pages (%s), trying THP\n",
+            strerror(errno));
+#endif
+    return NULL;
+}
+
+/*
+ * map_aligned - map size bytes with protection prot at addr (if not
+ *    NULL), or else at a huge page boundary.  A reservation at a fixed
+ *    address must not replace whatever is mapped there already.
+ */
+static char *map_aligned(void *addr, size_t size, int prot, int flags)
+{
+    size_t extra = addr ? 0 : MEM_HUGE_PAGE_SIZE;
+    int fixed = MAP_FIXED;
+    char *p, *start;
+
+#ifdef MAP_FIXED_NOREPLACE
+    if (flags & MAP_NORESERVE)
+        fixed = MAP_FIXED_NOREPLACE;
+#endif
+    p = mmap(addr, size + extra, prot,
+             (addr ? fixed : 0) | flags | MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (p == MAP_FAILED)
+        return MAP_FAILED;
+    if (addr && p != addr) {
+        fprintf(stderr, "mem_init_vm: could not obtain memory at address %p\n", addr);
+        munmap(p, size);
+        return MAP_FAILED;
+    }
+    start = (char *)(((unsigned long)p + extra) & ~(MEM_HUGE_PAGE_SIZE - 1));
+    if (extra && start > p)
+        munmap(p, start - p);
+    if (extra && start + size < p + size + extra)
+        munmap(start + size, p + size + extra - (start + size));
+    return start;
+}
+
+/*
+ * advise_thp - ask for transparent huge pages for size bytes at start;
+ *    returns 1 if the kernel accepted the advice
+ */
+static int advise_thp(char *start, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+    if (madvise(start, size, MADV_HUGEPAGE) == 0)
+        return 1;
+    fprintf(stderr, "mem_init_vm: no transparent huge pages (%s)\n", strerror(errno));
+#endif
+    return 0;
+}
+
+/*
+ * advise_nohuge - keep transparent huge pages out of size bytes at
+ *    start, whatever the system-wide THP setting
+ */
+static void advise_nohuge(char *start, size_t size)
+{
+#ifdef MADV_NOHUGEPAGE
+    if (madvise(start, size, MADV_NOHUGEPAGE) < 0)
+        fprintf(stderr, "mem_init_vm: MADV_NOHUGEPAGE failed (%s)\n", strerror(errno));
+#endif
+}
+
+/*
+ * prefault - make size bytes at start resident now rather than on
+ *    first touch
+ */
+static void prefault(char *start, size_t size)
+{
+    size_t page = getpagesize();
+    char *p;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(start, size, MADV_POPULATE_WRITE) == 0)
+        return;
+#endif
+    for (p = start; p < start + size; p += page)
+        *(volatile char *)p = 0;
+}
+
+/*
+ * heap_commit - make heap h read-write up to at least upto, in steps
+ *    of MEM_COMMIT_CHUNK (of pages for MEM_SYSCALL).  Returns 0 on
+ *    success, -1 on failure.
+ */
+static int heap_commit(mem_heap_t *h, char *upto)
+{
+    size_t step = h->use_mmap & MEM_SYSCALL ? (size_t)getpagesize() : MEM_COMMIT_CHUNK;
+    size_t used = upto - h->start_brk;
+    char *end = h->start_brk + (used + step - 1) / step * step;
+
+    if (end > h->max_addr)
+        end = h->max_addr;
+    if (mprotect(h->committed, end - h->committed, PROT_READ|PROT_WRITE) < 0) {
+        perror("mem_sbrk: mprotect");
+        return -1;
+    }
+    if (h->use_mmap & MEM_PREFAULT)
+        prefault(h->committed, end - h->committed);
+    h->committed = end;
+    return 0;
+}
+
+/*
+ * heap_grow_syscall - MEM_SYSCALL: enter the kernel for a growth of
+ *    heap h that fits in pages already committed, as brk() would
+ */
+static void heap_grow_syscall(mem_heap_t *h, int incr)
+{
+    size_t page = getpagesize();
+    char *lo = (char *)((unsigned long)h->brk & ~(page - 1));
+    char *hi = (char *)(((unsigned long)(h->brk + incr) + page - 1) & ~(page - 1));
+
+    if (hi > lo && mprotect(lo, hi - lo, PROT_READ|PROT_WRITE) < 0)
+        perror("mem_sbrk: mprotect");
+}
+
+/*
+ * heap_decommit - hand the pages heap h has touched back to the kernel,
+ *    so they fault in afresh; a reservation is made PROT_NONE again
+ */
+static void heap_decommit(mem_heap_t *h)
 {
-    use_mmap = _use_mmap;
+    size_t page = h->hugepages == MEM_HUGETLB ? MEM_HUGE_PAGE_SIZE : (size_t)getpagesize();
+    char *lo = (char *)(((unsigned long)h->start_brk + page - 1) & ~(page - 1));
+    char *hi = h->use_mmap & MEM_RESERVE ? h->committed : h->top;
+
+    /* a malloc'd heap may share its first and last pages with others */
+    hi = (char *)((unsigned long)(h->use_mmap ? hi + page - 1 : hi) & ~(page - 1));
+    if (hi > lo && madvise(lo, hi - lo, MADV_DONTNEED) < 0)
+        perror("mem_heap_decommit: madvise");
+    if ((h->use_mmap & MEM_RESERVE) && h->committed > h->start_brk) {
+        if (mprotect(h->start_brk, h->committed - h->start_brk, PROT_NONE) < 0)
+            perror("mem_heap_decommit: mprotect");
+        h->committed = h->start_brk;
+    }
+    h->top = h->start_brk;
+}
+
+/*
+ * heap_reserve - reserve size bytes for heap h, at addr if not NULL.
+ *    Returns 0 on success, -1 on failure.
+ */
+static int heap_reserve(mem_heap_t *h, size_t size, int use_mmap, void *addr)
+{
+    if (use_mmap & MEM_SYSCALL)
+        use_mmap |= MEM_RESERVE;
+    if (use_mmap & ~MEM_MMAP)
+        use_mmap |= MEM_MMAP;
+    if (use_mmap & (MEM_HUGETLB | MEM_THP | MEM_RESERVE))
+        size = (size + MEM_HUGE_PAGE_SIZE - 1) & ~(MEM_HUGE_PAGE_SIZE - 1);
+    h->use_mmap = use_mmap;
+    h->reserved = size;
+    h->hugepages = 0;
+    h->grow_calls = 0;
 
     /* allocate the storage we will use to model the available VM */
-    if (use_mmap) {
-        mem_start_brk = (char *)mmap(mmap_addr, MAX_HEAP, PROT_READ|PROT_WRITE, 
-                                 MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
-        if (mem_start_brk == MAP_FAILED) {
+    if (use_mmap & MEM_RESERVE) {
+        /* explicit huge pages can't be committed piecemeal; use THP */
+        h->start_brk = map_aligned(addr, size, PROT_NONE, MAP_NORESERVE);
+        if (h->start_brk == MAP_FAILED) {
+            perror("mem_init_vm: mmap error:");
+            return -1;
+        }
+        if ((use_mmap & (MEM_HUGETLB | MEM_THP)) && advise_thp(h->start_brk, size))
+            h->hugepages = MEM_THP;
+        else if (use_mmap & MEM_NOHUGE)
+            advise_nohuge(h->start_brk, size);
+        h->max_addr = h->start_brk + size;
+        h->brk = h->committed = h->top = h->start_brk;
+        return 0;
+    } else if ((use_mmap & MEM_HUGETLB) && (h->start_brk = map_hugetlb(addr, size)) != NULL) {
+        h->hugepages = MEM_HUGETLB;
+    } else if (use_mmap & (MEM_HUGETLB | MEM_THP)) {
+        if ((h->start_brk = map_aligned(addr, size, PROT_READ|PROT_WRITE, 0)) == MAP_FAILED) {
             perror("mem_init_vm: mmap error:");
-            exit(1);
+            return -1;
         }
-        if (mem_start_brk != mmap_addr) {
+        if (advise_thp(h->start_brk, size))
+            h->hugepages = MEM_THP;
+    } else if (use_mmap) {
+        h->start_brk = (char *)mmap(addr, size, PROT_READ|PROT_WRITE,
+                                    (addr ? MAP_FIXED : 0) | MAP_ANONYMOUS | MAP_PRIVATE,
+                                    -1, 0);
+        if (h->start_brk == MAP_FAILED) {
+            perror("mem_init_vm: mmap error:");
+            return -1;
+        }
+        if (addr && h->start_brk != addr) {
             perror("mmap");
             fprintf(stderr, 
                 "mem_init_vm: could not obtain memory at address %p\n", 
-                mmap_addr);
-            exit(1);
+                addr);
+            munmap(h->start_brk, size);
+            return -1;
         }
+        if (use_mmap & MEM_NOHUGE)
+            advise_nohuge(h->start_brk, size);
     } else {
-        if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+        if ((h->start_brk = (char *)malloc(size)) == NULL) {
             fprintf(stderr, "mem_init_vm: malloc error\n");
-            exit(1);
+            return -1;
         }
     }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    if (use_mmap & MEM_PREFAULT)
+        prefault(h->start_brk, size);
+    h->max_addr = h->start_brk + size;  /* max legal heap address */
+    h->committed = h->max_addr;         /* all of it is read-write */
+    h->brk = h->top = h->start_brk;     /* heap is empty initially */
+    return 0;
 }
 
-/* 
- * mem_deinit - free the storage used by the memory system model
+/*
+ * heap_release - give back the storage reserved for heap h
  */
-void mem_deinit(void)
+static void heap_release(mem_heap_t *h)
 {
-    if (use_mmap) {
-        if (munmap(mem_start_brk, MAX_HEAP))
+    if (h->use_mmap) {
+        if (munmap(h->start_brk, h->reserved))
             perror("munmap");
     } else {
-        free(mem_start_brk);
+        free(h->start_brk);
     }
+    h->start_brk = h->brk = h->max_addr = NULL;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * heap - the heap the mem_* wrappers operate on in this thread
  */
-void mem_reset_brk()
+static inline mem_heap_t *heap(void)
 {
-    mem_brk = mem_start_brk;
+    return cur_heap ? cur_heap : &default_heap;
 }
 
-/* 
- * mem_sbrk - simple model of the sbrk function. Extends the heap 
+/*
+ * mem_heap_create - create a new simulated heap of at most max_size bytes.
+ *    Returns NULL if the storage cannot be reserved.
+ */
+mem_heap_t *mem_heap_create(size_t max_size, int use_mmap)
+{
+    mem_heap_t *h = malloc(sizeof(*h));
+
+    if (h == NULL)
+        return NULL;
+    if (heap_reserve(h, max_size, use_mmap, NULL) < 0) {
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+/*
+ * mem_heap_destroy - free the storage used by a heap from mem_heap_create
+ */
+void mem_heap_destroy(mem_heap_t *h)
+{
+    if (cur_heap == h)
+        cur_heap = NULL;
+    heap_release(h);
+    free(h);
+}
+
+/*
+ * mem_heap_select - make h the heap used by the mem_* wrappers in the
+ *    calling thread.  NULL selects the default heap again.
+ */
+void mem_heap_select(mem_heap_t *h)
+{
+    cur_heap = h;
+}
+
+/*
+ * mem_heap_default - return the heap set up by mem_init()
+ */
+mem_heap_t *mem_heap_default(void)
+{
+    return &default_heap;
+}
+
+/*
+ * mem_heap_reset - reset the simulated brk pointer to make an empty heap
+ */
+void mem_heap_reset(mem_heap_t *h)
+{
+    /* give the pages back, so the next run faults them in afresh */
+    if (h->use_mmap & MEM_SYSCALL)
+        heap_decommit(h);
+    h->brk = h->start_brk;
+}
+
+/*
+ * mem_heap_decommit - empty heap h and give all its memory back to the
+ *    kernel, so that the next run starts with nothing resident
+ */
+void mem_heap_decommit(mem_heap_t *h)
+{
+    heap_decommit(h);
+    h->brk = h->start_brk;
+}
+
+/*
+ * mem_heap_sbrk - simple model of the sbrk function. Extends the heap
  *    by incr bytes and returns the start address of the new area. In
  *    this model, the heap cannot be shrunk.
  */
-void *mem_sbrk(int incr) 
+void *mem_heap_sbrk(mem_heap_t *h, int incr)
 {
-    char *old_brk = mem_brk;
+    char *old_brk = h->brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ( (incr < 0) || ((h->brk + incr) > h->max_addr)) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk(%d) failed. Ran out of memory...\n", incr);
 	return NULL;
     }
-    mem_brk += incr;
+    if (incr > 0)
+        h->grow_calls++;
+    if (h->brk + incr > h->committed) {
+        if (heap_commit(h, h->brk + incr) < 0) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    } else if (incr > 0 && (h->use_mmap & MEM_SYSCALL)) {
+        heap_grow_syscall(h, incr);
+    }
+    h->brk += incr;
+    if (h->brk > h->top)
+        h->top = h->brk;
     return (void *)old_brk;
 }
 
+/*
+ * mem_heap_lo_of - return address of the first byte of heap h
+ */
+void *mem_heap_lo_of(mem_heap_t *h)
+{
+    return (void *)h->start_brk;
+}
+
+/*
+ * mem_heap_hi_of - return address of the last byte of heap h
+ */
+void *mem_heap_hi_of(mem_heap_t *h)
+{
+    return (void *)(h->brk - 1);
+}
+
+/*
+ * mem_heapsize_of - returns the size of heap h in bytes
+ */
+size_t mem_heapsize_of(mem_heap_t *h)
+{
+    return (size_t)(h->brk - h->start_brk);
+}
+
+/*
+ * mem_heap_hugepages - MEM_HUGETLB or MEM_THP if heap h is backed by
+ *    huge pages, else 0
+ */
+int mem_heap_hugepages(mem_heap_t *h)
+{
+    return h->hugepages;
+}
+
+/*
+ * mem_heap_grow_calls - number of mem_sbrk calls that grew heap h
+ */
+unsigned long mem_heap_grow_calls(mem_heap_t *h)
+{
+    return h->grow_calls;
+}
+
+/*
+ * mem_heap_resident - bytes of heap h, up to its break, that the kernel
+ *    holds in memory; a page counts in full if any of it is heap
+ */
+size_t mem_heap_resident(mem_heap_t *h)
+{
+    static unsigned char vec[4096];
+    size_t page = getpagesize();
+    char *lo = (char *)((unsigned long)h->start_brk & ~(page - 1));
+    char *hi = (char *)(((unsigned long)h->brk + page - 1) & ~(page - 1));
+    size_t pages, i, resident = 0;
+
+    for (; lo < hi; lo += pages * page) {
+        pages = (hi - lo) / page;
+        if (pages > sizeof(vec))
+            pages = sizeof(vec);
+        if (mincore(lo, pages * page, vec) < 0) {
+            perror("mem_heap_resident: mincore");
+            break;
+        }
+        for (i = 0; i < pages; i++)
+            resident += vec[i] & 1;
+    }
+    return resident * page;
+}
+
+/*
+ * The functions below are the original single-heap interface.  They
+ * act on the heap selected by the calling thread, which is the default
+ * heap unless mem_heap_select() says otherwise.
+ */
+
+/* 
+ * mem_init - initialize the memory system model
+ */
+void mem_init(int _use_mmap)
+{
+    if (heap_reserve(&default_heap, _use_mmap & MEM_RESERVE ? MAX_RESERVE : MAX_HEAP,
+                     _use_mmap, _use_mmap ? mmap_addr : NULL) < 0)
+        exit(1);
+}
+
+/* 
+ * mem_deinit - free the storage used by the memory system model
+ */
+void mem_deinit(void)
+{
+    heap_release(&default_heap);
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ */
+void mem_reset_brk()
+{
+    mem_heap_reset(heap());
+}
+
+/*
+ * mem_decommit - empty the heap and give its memory back to the kernel
+ */
+void mem_decommit()
+{
+    mem_heap_decommit(heap());
+}
+
+/* 
+ * mem_sbrk - extend the current heap by incr bytes, see mem_heap_sbrk
+ */
+void *mem_sbrk(int incr) 
+{
+    return mem_heap_sbrk(heap(), incr);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
 void *mem_heap_lo()
 {
-    return (void *)mem_start_brk;
+    return mem_heap_lo_of(heap());
 }
 
 /* 
@@ -106,7 +522,7 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return mem_heap_hi_of(heap());
 }
 
 /*
@@ -114,7 +530,31 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return mem_heapsize_of(heap());
+}
+
+/*
+ * mem_hugepages() - MEM_HUGETLB or MEM_THP if the heap has huge pages
+ */
+int mem_hugepages()
+{
+    return mem_heap_hugepages(heap());
+}
+
+/*
+ * mem_grow_calls() - number of mem_sbrk calls that grew the heap
+ */
+unsigned long mem_grow_calls()
+{
+    return mem_heap_grow_calls(heap());
+}
+
+/*
+ * mem_resident() - bytes of the heap resident in memory
+ */
+size_t mem_resident()
+{
+    return mem_heap_resident(heap());
 }
 
 /*
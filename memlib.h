@@ -1,11 +1,57 @@
 #include <unistd.h>
 
+/*
+ * Flags for the use_mmap argument of mem_init() and mem_heap_create().
+ * All but MEM_MMAP imply it.  MEM_HUGETLB falls back to MEM_THP, and
+ * that to ordinary pages, if the system can't oblige.  MEM_RESERVE
+ * makes mem_init() reserve MAX_RESERVE bytes instead of MAX_HEAP, but
+ * only commits (and pays for) what mem_sbrk() hands out; MEM_PREFAULT
+ * touches memory as it is committed, so the heap takes no page faults.
+ * MEM_SYSCALL charges each growth what it costs a real process: one
+ * mprotect() per mem_sbrk() and fresh pages that fault on first touch,
+ * since resetting the heap hands its memory back to the kernel.
+ * MEM_NOHUGE keeps transparent huge pages out of a heap, even where the
+ * system hands them out unasked (THP "always").
+ */
+#define MEM_MMAP      1     /* reserve with mmap() instead of malloc() */
+#define MEM_HUGETLB   2     /* explicit huge pages (MAP_HUGETLB) */
+#define MEM_THP       4     /* transparent huge pages (MADV_HUGEPAGE) */
+#define MEM_RESERVE   8     /* PROT_NONE reservation, committed on demand */
+#define MEM_PREFAULT 16     /* pre-touch memory when it is committed */
+#define MEM_SYSCALL  32     /* a syscall per growth, fresh pages per reset */
+#define MEM_NOHUGE   64     /* never huge pages (MADV_NOHUGEPAGE) */
+#define MEM_HUGE_PAGE_SIZE  (2UL << 20)
+
 void mem_init(int use_mmap);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void); 
+void mem_decommit(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+int mem_hugepages(void);
+unsigned long mem_grow_calls(void);
+size_t mem_resident(void);
+
+/*
+ * Independent simulated heaps.  The functions above operate on the
+ * default heap created by mem_init(), unless the calling thread has
+ * selected another one with mem_heap_select().
+ */
+typedef struct mem_heap mem_heap_t;
 
+mem_heap_t *mem_heap_create(size_t max_size, int use_mmap);
+void mem_heap_destroy(mem_heap_t *heap);
+void mem_heap_select(mem_heap_t *heap);
+mem_heap_t *mem_heap_default(void);
+void *mem_heap_sbrk(mem_heap_t *heap, int incr);
+void mem_heap_reset(mem_heap_t *heap);
+void mem_heap_decommit(mem_heap_t *heap);
+void *mem_heap_lo_of(mem_heap_t *heap);
+void *mem_heap_hi_of(mem_heap_t *heap);
+size_t mem_heapsize_of(mem_heap_t *heap);
+int mem_heap_hugepages(mem_heap_t *heap);
+unsigned long mem_heap_grow_calls(mem_heap_t *heap);
+size_t mem_heap_resident(mem_heap_t *heap);
@@ -0,0 +1,143 @@
+/*
+ * mkclasses.c - Size-class table generator
+ *
+ * Writes sizeclass.h, the table of size classes shared by the
+ * allocator, its statistics and the driver.  Requests of up to
+ * SC_SMALL_MAX bytes fall into classes SC_ALIGN bytes apart, found
+ * with one load from a byte-granular table.  Larger requests fall into
+ * SC_GROUPS classes per power of two (log-linear classes), found with
+ * a count-leading-zeros and a shift.  The number of groups is the
+ * smallest power of two that keeps the space a large request can waste
+ * by rounding up to its class within the bound given with -w.
+ *
+ * The Makefile regenerates sizeclass.h from SC_SMALL_MAX and SC_WASTE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define SC_ALIGN   8    /* spacing of the small classes */
+#define SC_MIN    16    /* smallest class */
+#define SC_LG_MAX 31    /* largest class is 1 << SC_LG_MAX bytes */
+
+static unsigned long small_max = 1024;  /* -s */
+static double waste = 25;               /* -w, in percent */
+
+static int lg(unsigned long x)
+{
+    int k = 0;
+
+    while (x >>= 1)
+        k++;
+    return k;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mkclasses [-s <bytes>] [-w <percent>] > sizeclass.h\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-s <bytes>    Largest size served by the lookup table, a power of two.\n");
+    fprintf(stderr, "\t-w <percent>  Most a larger request may waste by rounding up.\n");
+}
+
+int main(int argc, char **argv)
+{
+    int lg_small, lg_groups, groups, nsmall, nclasses, i, k, c;
+
+    while ((c = getopt(argc, argv, "s:w:h")) != EOF) {
+        switch (c) {
+        case 's':
+            small_max = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            waste = atof(optarg);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    lg_small = lg(small_max);
+    if (small_max < 4 * SC_MIN || small_max != 1UL << lg_small || lg_small >= SC_LG_MAX) {
+        fprintf(stderr, "mkclasses: -s must be a power of two from %d to 2^%d\n",
+                4 * SC_MIN, SC_LG_MAX - 1);
+        exit(1);
+    }
+
+    /* groups per doubling: a class then spans 1/groups of its lower bound */
+    for (lg_groups = 0; 100.0 / (1 << lg_groups) > waste; lg_groups++)
+        if ((small_max >> (lg_groups + 1)) < SC_ALIGN) {
+            fprintf(stderr, "mkclasses: cannot waste less than %.2f%% above %lu bytes\n",
+                    100.0 / (1 << lg_groups), small_max);
+            exit(1);
+        }
+    groups = 1 << lg_groups;
+    nsmall = (small_max - SC_MIN) / SC_ALIGN + 1;
+    nclasses = nsmall + (SC_LG_MAX - lg_small) * groups;
+
+    printf("/*\n"
+           " * sizeclass.h - size classes, generated by mkclasses -s %lu -w %g\n"
+           " * Do not edit; set SC_SMALL_MAX and SC_WASTE in the Makefile instead.\n"
+           " *\n"
+           " * Sizes up to SC_SMALL_MAX map to classes SC_ALIGN bytes apart through\n"
+           " * sc_small_class[]; larger sizes up to SC_MAX to SC_GROUPS classes per\n"
+           " * power of two, so rounding up wastes at most 1/SC_GROUPS of them.\n"
+           " */\n", small_max, waste);
+    printf("#ifndef __SIZECLASS_H_\n#define __SIZECLASS_H_\n\n");
+    printf("#include <stddef.h>\n#include <stdint.h>\n\n");
+    printf("#define SC_ALIGN      %d\n", SC_ALIGN);
+    printf("#define SC_MIN        %d\n", SC_MIN);
+    printf("#define SC_SMALL_MAX  %lu\n", small_max);
+    printf("#define SC_LG_SMALL   %d\n", lg_small);
+    printf("#define SC_NSMALL     %d\n", nsmall);
+    printf("#define SC_LG_GROUPS  %d\n", lg_groups);
+    printf("#define SC_GROUPS     %d\n", groups);
+    printf("#define SC_LG_MAX     %d\n", SC_LG_MAX);
+    printf("#define SC_MAX        ((size_t)1 << SC_LG_MAX)\n");
+    printf("#define SC_NCLASSES   %d\n\n", nclasses);
+
+    printf("/* class of each size up to SC_SMALL_MAX */\n");
+    printf("static const %s sc_small_class[SC_SMALL_MAX + 1] __attribute__((unused)) = {",
+           nclasses <= 256 ? "uint8_t" : "uint16_t");
+    for (i = 0; i <= (int)small_max; i++) {
+        int cls = i <= SC_MIN ? 0 : (i - SC_MIN + SC_ALIGN - 1) / SC_ALIGN;
+        printf("%s%d,", i % 16 == 0 ? "\n    " : " ", cls);
+    }
+    printf("\n};\n\n");
+
+    printf("/* size of each class, in bytes */\n");
+    printf("static const uint32_t sc_class_size[SC_NCLASSES] __attribute__((unused)) = {");
+    for (i = 0; i < nsmall; i++)
+        printf("%s%d,", i % 8 == 0 ? "\n    " : " ", SC_MIN + i * SC_ALIGN);
+    for (k = lg_small; k < SC_LG_MAX; k++)
+        for (c = 0; c < groups; c++, i++)
+            printf("%s%lu,", i % 8 == 0 ? "\n    " : " ",
+                   (1UL << k) + (unsigned long)(c + 1) * (1UL << (k - lg_groups)));
+    printf("\n};\n\n");
+
+    printf("/*\n"
+           " * sc_class - the class of a request of size bytes, for size <= SC_MAX\n"
+           " */\n"
+           "static inline unsigned sc_class(size_t size)\n"
+           "{\n"
+           "    unsigned lg;\n"
+           "\n"
+           "    if (size <= SC_SMALL_MAX)\n"
+           "        return sc_small_class[size];\n"
+           "    lg = 8 * sizeof(long) - 1 - __builtin_clzl(size - 1);\n"
+           "    return SC_NSMALL + ((lg - SC_LG_SMALL) << SC_LG_GROUPS) +\n"
+           "        (((size - 1) >> (lg - SC_LG_GROUPS)) & (SC_GROUPS - 1));\n"
+           "}\n\n");
+    printf("/*\n"
+           " * sc_round - size rounded up to its class\n"
+           " */\n"
+           "static inline size_t sc_round(size_t size)\n"
+           "{\n"
+           "    return sc_class_size[sc_class(size)];\n"
+           "}\n\n");
+    printf("#endif /* __SIZECLASS_H_ */\n");
+    return 0;
+}
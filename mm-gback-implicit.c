@@ -87,20 +87,19 @@ static size_t blk_size(struct block *blk) {
 static struct block *prev_blk(struct block *blk) {
     struct boundary_tag *prevfooter = prev_blk_footer(blk);
     assert(prevfooter->size != 0);
-    return (struct block *)((size_t *)blk - prevfooter->size);
+    return (struct block *)((char *)blk - prevfooter->size * WSIZE);
 }
 
 /* Given a block, obtain pointer to next block.
    Not meaningful for right-most block. */
 static struct block *next_blk(struct block *blk) {
     assert(blk_size(blk) != 0);
-    return (struct block *)((size_t *)blk + blk->header.size);
+    return (struct block *)((char *)blk + blk->header.size * WSIZE);
 }
 
 /* Given a block, obtain its footer boundary tag */
 static struct boundary_tag * get_footer(struct block *blk) {
-    return (void *)((size_t *)blk + blk->header.size) 
-                   - sizeof(struct boundary_tag);
+    return (struct boundary_tag *)((char *)blk + blk->header.size * WSIZE) - 1;
 }
 
 /* Set a block's size and inuse bit in header and footer */
@@ -286,6 +285,26 @@ void mm_checkheap(int verbose)
 { 
 }
 
+/*
+ * mm_heapstats - report free space by walking the implicit list.
+ *    Every free block counts as an index node; there are no duplicates.
+ */
+void mm_heapstats(struct mm_heapstats *stats)
+{
+    struct block *bp;
+
+    memset(stats, 0, sizeof(*stats));
+    for (bp = heap_listp; blk_size(bp) > 0; bp = next_blk(bp)) {
+        if (!blk_free(bp))
+            continue;
+        stats->free_blocks++;
+        stats->free_bytes += blk_size(bp) * WSIZE;
+        if (blk_size(bp) * WSIZE > stats->largest_free)
+            stats->largest_free = blk_size(bp) * WSIZE;
+    }
+    stats->index_nodes = stats->free_blocks;
+}
+
 /* 
  * The remaining routines are internal helper routines 
  */
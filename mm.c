@@ -3,15 +3,17 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <assert.h>
+#include <ctype.h>
 
-//#include "mm_ts.c"
+#include "mm_ts.c"
 #include "memlib.h"
 #include "mm.h"
-#include "tree.h"
 #include "list.h"
+#include "sizeclass.h"
 
 /*this implementation of malloc uses a rb_tree to keep track of free blocks
  *in addition to the tree, this implemenation makes each block a part of a duplicate size list
@@ -20,6 +22,18 @@
  *size in the tree. Add block operation and remove block operation is straightforward, change
  *block pointers if the block is a duplicate, otherwise pop it from the tree or insert it into the tree
  *
+ *Free blocks link to each other with 32-bit heap offsets rather than pointers, and the node color
+ *lives in a spare bit of the parent link, so the free-block links take 16 bytes on any platform
+ *and the minimum block is 6 words
+ *
+ *Built with FREE_INDEX_BTREE, the free blocks are indexed by a B+tree kept outside the heap
+ *instead, with a list of free blocks for each size in its leaves (see index_insert); built with
+ *FREE_INDEX_SPLAY, by a splay tree over the same links as the RB tree, which keeps recently used
+ *sizes near its root
+ *
+ *Free blocks of up to SMALL_WORDS words bypass either index: each such size has a list of its
+ *own, and a two-level bitmap of the sizes with free blocks finds the best fit in a few bit scans
+ *
  *Malloc has a profiling sysmtem(meaning give more size than requested so that it can deal with the
  *extreme case in binary file) to make sure the space utilization to be the best
  *
@@ -29,6 +43,15 @@
  *calling extendheap or mm_malloc when it's possible
  *
  *mm_free coalesces and free blocks.
+ *
+ *The policy constants below are defaults. mm_init reads overrides from the MM_OPTIONS
+ *environment variable, once, into a config struct that is only read after that.
+ *
+ *In the THREAD_SAFE build, requests of up to SLAB_MAX_PAYLOAD bytes come from per-thread slabs
+ *instead: line-aligned runs of equal-sized slots carved out of one ordinary block. A slab only
+ *ever hands out slots to the thread that owns it, so small blocks given to different threads
+ *never share a cache line. Each slot keeps a 4-byte tag in front of its payload, like a header,
+ *whose negative size leads back to the slab; that is how mm_free and mm_realloc tell them apart.
  *              
  */
 
@@ -49,44 +72,72 @@ const struct boundary_tag FENCE = { .inuse = 1, .size = 0 };
  */
 struct block {
     struct boundary_tag header; /* offset 0, at address 4 mod 8 */
-    //struct node elem;
     union { 					/* offset 4, at address 0 mod 8 */
         char payload[0];
-        RB_ENTRY(block) node;
-
+        struct {                /* free blocks only, as links (see link_blk) */
+            uint32_t left;      /* left child; on a duplicate list, the previous block */
+            uint32_t right;     /* right child */
+            uint32_t parent;    /* parent, with LINK_RED and LINK_DUP */
+            uint32_t next;      /* next block on the duplicate list */
+        } links;
     };
-    struct block* prev;
-    struct block* next;
 };
 
 /* Basic constants and macros */
 #define WSIZE       4       /* Word and header/footer size (bytes) */
 #define DSIZE       8       /* Doubleword size (bytes) */
-#define MIN_BLOCK_SIZE_WORDS 8 /* Minimum block size in words */
+#define MIN_BLOCK_SIZE_WORDS 6 /* Minimum block size in words */
+#if SC_ALIGN != DSIZE
+#error "alloc_block rounds small blocks to size classes; they must be DSIZE apart"
+#endif
 #define CHUNKSIZE  (1<<4)  /* Extend heap by this amount (words) */
+#define GROWTH_SLACK  0    /* most a growth may overshoot, in % of the heap; 0 is exact */
+#define GROWTH_WINDOW 64   /* growths fewer than this many allocations apart are pressure */
 #define PADDING 3   /*padding to find a block */
 #define DIV 84     /*magic number for profiling*/
 #define PT 2        /*define profiling timer*/
 #define MAX(x, y) ((x) > (y)? (x) : (y)) 
 
-static int block_compare(struct block * a, struct block * b) {
-
-    return a->header.size - b->header.size;   
-}
-
+/* Links are heap offsets in DSIZE units, 0 for none; the top two bits
+   of a parent link are flags */
+#define LINK_RED   (1u << 31)   /* the node is red */
+#define LINK_DUP   (1u << 30)   /* the block is on a duplicate list, not in the tree */
+#define LINK_MASK  (LINK_DUP - 1)
 
-/* initialize the root of RB tree*/
+static char *heap_base;     /* mem_heap_lo(), which links are relative to */
 
-RB_HEAD(rb_tree, block) tree;
-RB_GENERATE_STATIC(rb_tree, block, node, block_compare);
 static void add_free_block(struct block*);
 static void remove_free_block(struct block*);
+static void *alloc_block(size_t size);
+static void *malloc_nostats(size_t size);
+static void free_nostats(void *ptr);
 //static void print_tree(struct block*);
 /*prfofiling sizes*/
 static size_t first;
 static size_t second;
 static size_t first_timer;
 static size_t second_timer;
+/*heap growth controller*/
+static size_t grow_extra;          /* words added to the next growth */
+static size_t allocs_since_grow;
+
+/* Tunables; see read_options() for their names in MM_OPTIONS */
+static struct mm_config {
+    size_t chunk;           /* words of the first heap extension, and of a first overshoot */
+    size_t split;           /* smallest remainder, in words, split off a block */
+    size_t growth_slack;    /* most a growth may overshoot, in % of the heap */
+    size_t growth_window;   /* allocations between growths that count as pressure */
+    size_t profile_div;     /* initial sizes of the binary-trace profiler */
+    size_t profile_hits;    /* repeats before the profiler pads a request */
+    size_t slab_max;        /* largest request served from a slab (THREAD_SAFE) */
+    bool stats;             /* count calls and print them at exit */
+} config;
+
+/* Call counts, kept only if config.stats is set */
+static struct {
+    unsigned long mallocs, frees, reallocs, growths, slab_mallocs;
+    unsigned long classes[SC_NCLASSES];     /* mallocs by size class */
+} counts;
 
 /* Return size of block is free */
 static size_t blk_size(struct block *blk) { 
@@ -97,7 +148,7 @@ static size_t blk_size(struct block *blk) {
    Not meaningful for right-most block. */
 static struct block *next_blk(struct block *blk) {
     assert(blk_size(blk) != 0);
-    return (struct block *)((size_t *)blk + blk->header.size);
+    return (struct block *)((char *)blk + blk->header.size * WSIZE);
 }
 
 /* Given a block, obtain previous's block footer.
@@ -112,13 +163,12 @@ static struct block *prev_blk(struct block *blk) {
     struct boundary_tag *prevfooter = prev_blk_footer(blk);
     //if ((void *)(blk - 1) < mem_heap_lo()) return NULL;
     assert(prevfooter->size != 0);
-    return (struct block *)((size_t *)blk - prevfooter->size);
+    return (struct block *)((char *)blk - prevfooter->size * WSIZE);
 }
 
 /* Given a block, obtain its footer boundary tag */
 static struct boundary_tag * get_footer(struct block *blk) {
-    return (void *)((size_t *)blk + blk->header.size) 
-        - sizeof(struct boundary_tag);
+    return (struct boundary_tag *)((char *)blk + blk->header.size * WSIZE) - 1;
 }
 
 /* Set a block's size and inuse bit in header and footer */
@@ -143,32 +193,75 @@ static bool blk_free(struct block *blk) {
     return !blk->header.inuse; 
 }
 
+/* Convert between blocks and links */
+static uint32_t blk_link(struct block *blk) {
+    return blk != NULL ? ((char *)blk - heap_base + WSIZE) / DSIZE : 0;
+}
+
+static struct block *link_blk(uint32_t link) {
+    return link != 0 ? (struct block *)(heap_base + (size_t)link * DSIZE - WSIZE) : NULL;
+}
+
+/*
+ * The free-size index.  It keeps one list of the free blocks of each
+ * size, and finds the smallest size that fits a request:
+ *
+ *   index_init    start over with no free blocks
+ *   index_insert  add a free block
+ *   index_remove  take a free block out
+ *   index_fit     a free block of the smallest size >= asize words
+ *   index_stats   count free blocks and sizes for mm_heapstats
+ *
+ * By default the index is an RB tree threaded through the free blocks
+ * themselves; with FREE_INDEX_SPLAY, a splay tree threaded the same way;
+ * with FREE_INDEX_BTREE, a B+tree in a side arena.
+ */
+#if !defined(FREE_INDEX_BTREE) && !defined(FREE_INDEX_SPLAY)
+static uint32_t root;       /* root of the RB tree of free blocks */
+
+/* Tree links of a free block */
+static struct block *t_left(struct block *blk) {
+    return link_blk(blk->links.left);
+}
+
+static struct block *t_right(struct block *blk) {
+    return link_blk(blk->links.right);
+}
+
+static struct block *t_parent(struct block *blk) {
+    return link_blk(blk->links.parent & LINK_MASK);
+}
+
+static void t_set_parent(struct block *blk, struct block *parent) {
+    blk->links.parent = (blk->links.parent & LINK_RED) | blk_link(parent);
+}
+
+/* A missing node counts as black */
+static bool t_red(struct block *blk) {
+    return blk != NULL && (blk->links.parent & LINK_RED);
+}
+
+static void t_set_red(struct block *blk, bool red) {
+    blk->links.parent = red ? blk->links.parent | LINK_RED : blk->links.parent & ~LINK_RED;
+}
+
 /* memory checking tool for examing free blocks in the tree along with other list member of that size*/
     void
 print_tree(struct block *bp)
 {
-    struct block *left, *right;
+    struct block *left, *right, *dup;
     if (bp == NULL) {
         printf("nil");
         return;
     }
-    left = RB_LEFT(bp, node);
-    right = RB_RIGHT(bp, node);
-    if (left == NULL && right == NULL) {
-        while (bp != NULL){
-            printf("%d", bp->header.size);
-            bp = bp->next;
-            if (bp!=NULL)
-                printf("->");
-        }
+    left = t_left(bp);
+    right = t_right(bp);
+    for (dup = bp; dup != NULL; dup = link_blk(dup->links.next)) {
+        printf("%d", dup->header.size);
+        if (dup->links.next != 0)
+            printf("->");
     }
-    else {
-        while (bp != NULL){
-            printf("%d", bp->header.size);
-            bp = bp->next;
-            if (bp!=NULL)
-                printf("->");
-        }
+    if (left != NULL || right != NULL) {
         printf("(");
         print_tree(left);
         printf(",");
@@ -177,6 +270,916 @@ print_tree(struct block *bp)
     }
 }
 
+/*
+ * The RB tree of free blocks, keyed by size.  This is the algorithm of
+ * tree.h's RB_* macros, over links instead of pointers.
+ */
+
+/* make child take old's place under parent, or as the root */
+static void t_replace_child(struct block *parent, struct block *old, struct block *child)
+{
+    uint32_t link = blk_link(child);
+
+    if (parent == NULL)
+        root = link;
+    else if (parent->links.left == blk_link(old))
+        parent->links.left = link;
+    else
+        parent->links.right = link;
+}
+
+static void t_rotate_left(struct block *blk)
+{
+    struct block *r = t_right(blk), *rl = t_left(r);
+
+    blk->links.right = blk_link(rl);
+    if (rl != NULL)
+        t_set_parent(rl, blk);
+    t_set_parent(r, t_parent(blk));
+    t_replace_child(t_parent(blk), blk, r);
+    r->links.left = blk_link(blk);
+    t_set_parent(blk, r);
+}
+
+static void t_rotate_right(struct block *blk)
+{
+    struct block *l = t_left(blk), *lr = t_right(l);
+
+    blk->links.left = blk_link(lr);
+    if (lr != NULL)
+        t_set_parent(lr, blk);
+    t_set_parent(l, t_parent(blk));
+    t_replace_child(t_parent(blk), blk, l);
+    l->links.right = blk_link(blk);
+    t_set_parent(blk, l);
+}
+
+/*
+ * tree_insert - add free block bp to the tree, or if a block of its
+ *    size is already there, to that block's duplicate list
+ */
+static void tree_insert(struct block *bp)
+{
+    struct block *parent = NULL, *cur = link_blk(root), *gparent, *uncle;
+    int size = bp->header.size;
+
+    while (cur != NULL) {
+        if (size == cur->header.size) {
+            struct block *next = link_blk(cur->links.next);
+
+            bp->links.left = blk_link(cur);
+            bp->links.parent = LINK_DUP;
+            bp->links.next = cur->links.next;
+            if (next != NULL)
+                next->links.left = blk_link(bp);
+            cur->links.next = blk_link(bp);
+            return;
+        }
+        parent = cur;
+        cur = size < cur->header.size ? t_left(cur) : t_right(cur);
+    }
+    bp->links.left = bp->links.right = bp->links.next = 0;
+    bp->links.parent = blk_link(parent) | LINK_RED;
+    if (parent == NULL)
+        root = blk_link(bp);
+    else if (size < parent->header.size)
+        parent->links.left = blk_link(bp);
+    else
+        parent->links.right = blk_link(bp);
+
+    while ((parent = t_parent(bp)) != NULL && t_red(parent)) {
+        gparent = t_parent(parent);
+        if (parent == t_left(gparent)) {
+            uncle = t_right(gparent);
+            if (t_red(uncle)) {
+                t_set_red(uncle, false);
+                t_set_red(parent, false);
+                t_set_red(gparent, true);
+                bp = gparent;
+                continue;
+            }
+            if (bp == t_right(parent)) {
+                t_rotate_left(parent);
+                bp = parent;
+                parent = t_parent(bp);
+            }
+            t_set_red(parent, false);
+            t_set_red(gparent, true);
+            t_rotate_right(gparent);
+        } else {
+            uncle = t_left(gparent);
+            if (t_red(uncle)) {
+                t_set_red(uncle, false);
+                t_set_red(parent, false);
+                t_set_red(gparent, true);
+                bp = gparent;
+                continue;
+            }
+            if (bp == t_left(parent)) {
+                t_rotate_right(parent);
+                bp = parent;
+                parent = t_parent(bp);
+            }
+            t_set_red(parent, false);
+            t_set_red(gparent, true);
+            t_rotate_left(gparent);
+        }
+    }
+    t_set_red(link_blk(root), false);
+}
+
+/* restore the RB properties after removing a black node above blk */
+static void tree_remove_color(struct block *blk, struct block *parent)
+{
+    struct block *sib;
+
+    while (blk != link_blk(root) && !t_red(blk)) {
+        if (t_left(parent) == blk) {
+            sib = t_right(parent);
+            if (t_red(sib)) {
+                t_set_red(sib, false);
+                t_set_red(parent, true);
+                t_rotate_left(parent);
+                sib = t_right(parent);
+            }
+            if (!t_red(t_left(sib)) && !t_red(t_right(sib))) {
+                t_set_red(sib, true);
+                blk = parent;
+                parent = t_parent(blk);
+            } else {
+                if (!t_red(t_right(sib))) {
+                    t_set_red(t_left(sib), false);
+                    t_set_red(sib, true);
+                    t_rotate_right(sib);
+                    sib = t_right(parent);
+                }
+                t_set_red(sib, t_red(parent));
+                t_set_red(parent, false);
+                t_set_red(t_right(sib), false);
+                t_rotate_left(parent);
+                blk = link_blk(root);
+                break;
+            }
+        } else {
+            sib = t_left(parent);
+            if (t_red(sib)) {
+                t_set_red(sib, false);
+                t_set_red(parent, true);
+                t_rotate_right(parent);
+                sib = t_left(parent);
+            }
+            if (!t_red(t_left(sib)) && !t_red(t_right(sib))) {
+                t_set_red(sib, true);
+                blk = parent;
+                parent = t_parent(blk);
+            } else {
+                if (!t_red(t_left(sib))) {
+                    t_set_red(t_right(sib), false);
+                    t_set_red(sib, true);
+                    t_rotate_left(sib);
+                    sib = t_left(parent);
+                }
+                t_set_red(sib, t_red(parent));
+                t_set_red(parent, false);
+                t_set_red(t_left(sib), false);
+                t_rotate_right(parent);
+                blk = link_blk(root);
+                break;
+            }
+        }
+    }
+    if (blk != NULL)
+        t_set_red(blk, false);
+}
+
+/*
+ * tree_remove - take tree node bp, which has no duplicates, out of the tree
+ */
+static void tree_remove(struct block *bp)
+{
+    struct block *child, *parent, *succ;
+    bool red;
+
+    if (bp->links.left == 0 || bp->links.right == 0) {
+        child = bp->links.left != 0 ? t_left(bp) : t_right(bp);
+        parent = t_parent(bp);
+        red = t_red(bp);
+        if (child != NULL)
+            t_set_parent(child, parent);
+        t_replace_child(parent, bp, child);
+    } else {
+        /* splice out the successor, then put it in bp's place */
+        for (succ = t_right(bp); succ->links.left != 0; succ = t_left(succ))
+            ;
+        child = t_right(succ);
+        parent = t_parent(succ);
+        red = t_red(succ);
+        if (child != NULL)
+            t_set_parent(child, parent);
+        t_replace_child(parent, succ, child);
+        if (parent == bp)
+            parent = succ;
+        succ->links.left = bp->links.left;
+        succ->links.right = bp->links.right;
+        succ->links.parent = bp->links.parent;
+        t_replace_child(t_parent(bp), bp, succ);
+        t_set_parent(t_left(succ), succ);
+        if (succ->links.right != 0)
+            t_set_parent(t_right(succ), succ);
+    }
+    if (!red)
+        tree_remove_color(child, parent);
+}
+
+/*
+ * tree_replace - put free block blk in tree node bp's place, with its links
+ */
+static void tree_replace(struct block *bp, struct block *blk)
+{
+    blk->links.left = bp->links.left;
+    blk->links.right = bp->links.right;
+    blk->links.parent = bp->links.parent;
+    t_replace_child(t_parent(bp), bp, blk);
+    if (blk->links.left != 0)
+        t_set_parent(t_left(blk), blk);
+    if (blk->links.right != 0)
+        t_set_parent(t_right(blk), blk);
+}
+
+static int index_init(void)
+{
+    root = 0;
+    return 0;
+}
+
+static void index_insert(struct block *bp)
+{
+    tree_insert(bp);
+}
+
+static void index_remove(struct block *bp)
+{
+    if (bp->links.parent & LINK_DUP) {      //case1: a duplicate, after the tree node of its size
+        struct block* next = link_blk(bp->links.next);
+
+        link_blk(bp->links.left)->links.next = bp->links.next;
+        if (next != NULL)
+            next->links.left = bp->links.left;
+    }
+    else if (bp->links.next != 0) {         //case2: a tree node with duplicates; the first takes its place
+        tree_replace(bp, link_blk(bp->links.next));
+    }
+    else {                                  //case3: current block is a lonely child
+        tree_remove(bp);
+    }
+}
+
+/* Of several blocks of the best size, take a duplicate, which leaves
+   the tree as it is */
+static struct block *index_fit(size_t asize)
+{
+    struct block *cur = link_blk(root), *bp = NULL;
+
+    while (cur != NULL) {
+        if ((size_t)cur->header.size >= asize) {
+            bp = cur;
+            if ((size_t)cur->header.size == asize)
+                break;
+            cur = t_left(cur);
+        } else
+            cur = t_right(cur);
+    }
+    if (bp != NULL && bp->links.next != 0)
+        bp = link_blk(bp->links.next);
+    return bp;
+}
+
+/* add the free blocks in the subtree under bp to stats */
+static void stats_walk(struct block *bp, struct mm_heapstats *stats)
+{
+    struct block *dup;
+
+    if (bp == NULL)
+        return;
+    stats->index_nodes++;
+    for (dup = bp; dup != NULL; dup = link_blk(dup->links.next)) {
+        stats->free_blocks++;
+        stats->free_bytes += blk_size(dup) * WSIZE;
+    }
+    stats_walk(t_left(bp), stats);
+    stats_walk(t_right(bp), stats);
+}
+
+static void index_stats(struct mm_heapstats *stats)
+{
+    struct block *bp;
+
+    stats_walk(link_blk(root), stats);
+    for (bp = link_blk(root); bp != NULL && bp->links.right != 0; bp = t_right(bp))
+        ;
+    if (bp != NULL)
+        stats->largest_free = blk_size(bp) * WSIZE;
+}
+
+#elif defined(FREE_INDEX_SPLAY)
+/*
+ * A top-down splay tree (Sleator and Tarjan, as SPLAY_SPLAY in tree.h
+ * does it, but over links).  Each search moves the size it looks for,
+ * or a neighbour, to the root, so sizes requested in bursts are found
+ * in a step or two.  Tree nodes need no parent or color; the parent
+ * link only carries LINK_DUP, and a duplicate list hangs off each node
+ * as in the RB tree.
+ */
+static uint32_t root;       /* root of the splay tree of free blocks */
+
+/*
+ * splay - splay the subtree t on size, returning its new root: the
+ *    node of that size, or else the last node on the path to it
+ */
+static uint32_t splay(uint32_t size, uint32_t t)
+{
+    uint32_t ltree = 0, rtree = 0;          /* nodes below and above size */
+    uint32_t *lhook = &ltree, *rhook = &rtree;
+    struct block *n, *y;
+
+    if (t == 0)
+        return 0;
+    for (;;) {
+        n = link_blk(t);
+        if (size < n->header.size) {
+            if (n->links.left == 0)
+                break;
+            y = link_blk(n->links.left);
+            if (size < y->header.size) {    /* rotate right */
+                n->links.left = y->links.right;
+                y->links.right = t;
+                t = blk_link(y);
+                n = y;
+                if (n->links.left == 0)
+                    break;
+            }
+            *rhook = t;                     /* link right */
+            rhook = &n->links.left;
+            t = n->links.left;
+        } else if (size > n->header.size) {
+            if (n->links.right == 0)
+                break;
+            y = link_blk(n->links.right);
+            if (size > y->header.size) {    /* rotate left */
+                n->links.right = y->links.left;
+                y->links.left = t;
+                t = blk_link(y);
+                n = y;
+                if (n->links.right == 0)
+                    break;
+            }
+            *lhook = t;                     /* link left */
+            lhook = &n->links.right;
+            t = n->links.right;
+        } else
+            break;
+    }
+    *lhook = n->links.left;                 /* assemble */
+    *rhook = n->links.right;
+    n->links.left = ltree;
+    n->links.right = rtree;
+    return t;
+}
+
+static int index_init(void)
+{
+    root = 0;
+    return 0;
+}
+
+static void index_insert(struct block *bp)
+{
+    uint32_t val = blk_link(bp);
+    struct block *n, *next;
+
+    bp->links.parent = bp->links.next = 0;
+    if (root == 0) {
+        bp->links.left = bp->links.right = 0;
+        root = val;
+        return;
+    }
+    root = splay(bp->header.size, root);
+    n = link_blk(root);
+    if (bp->header.size == n->header.size) {    /* after the node of its size */
+        bp->links.parent = LINK_DUP;
+        bp->links.left = root;
+        bp->links.next = n->links.next;
+        if ((next = link_blk(n->links.next)) != NULL)
+            next->links.left = val;
+        n->links.next = val;
+        return;
+    }
+    if (bp->header.size < n->header.size) {
+        bp->links.left = n->links.left;
+        bp->links.right = root;
+        n->links.left = 0;
+    } else {
+        bp->links.right = n->links.right;
+        bp->links.left = root;
+        n->links.right = 0;
+    }
+    root = val;
+}
+
+static void index_remove(struct block *bp)
+{
+    struct block *next = link_blk(bp->links.next);
+
+    if (bp->links.parent & LINK_DUP) {      //case1: a duplicate, after the tree node of its size
+        link_blk(bp->links.left)->links.next = bp->links.next;
+        if (next != NULL)
+            next->links.left = bp->links.left;
+        return;
+    }
+    root = splay(bp->header.size, root);
+    assert(root == blk_link(bp));
+    if (next != NULL) {                     //case2: the first duplicate takes its place
+        next->links.parent = 0;
+        next->links.left = bp->links.left;
+        next->links.right = bp->links.right;
+        root = bp->links.next;
+    } else if (bp->links.left == 0) {       //case3: no smaller sizes
+        root = bp->links.right;
+    } else {                                //case4: the largest smaller size becomes the root
+        root = splay(bp->header.size, bp->links.left);
+        link_blk(root)->links.right = bp->links.right;
+    }
+}
+
+/* Of several blocks of the best size, take a duplicate, which leaves
+   the tree as it is */
+static struct block *index_fit(size_t asize)
+{
+    struct block *bp;
+
+    if (root == 0 || asize > LINK_MASK)
+        return NULL;
+    root = splay(asize, root);
+    bp = link_blk(root);
+    if ((size_t)bp->header.size < asize) {  /* the root is the next smaller size */
+        if (bp->links.right == 0)
+            return NULL;
+        bp->links.right = splay(asize, bp->links.right);
+        bp = link_blk(bp->links.right);
+    }
+    if (bp->links.next != 0)
+        bp = link_blk(bp->links.next);
+    return bp;
+}
+
+/* add the free blocks in the subtree under bp to stats */
+static void stats_walk(struct block *bp, struct mm_heapstats *stats)
+{
+    struct block *dup;
+
+    for (; bp != NULL; bp = link_blk(bp->links.right)) {   /* recurse on the left only */
+        stats->index_nodes++;
+        for (dup = bp; dup != NULL; dup = link_blk(dup->links.next)) {
+            stats->free_blocks++;
+            stats->free_bytes += blk_size(dup) * WSIZE;
+        }
+        stats_walk(link_blk(bp->links.left), stats);
+    }
+}
+
+static void index_stats(struct mm_heapstats *stats)
+{
+    struct block *bp;
+
+    stats_walk(link_blk(root), stats);
+    for (bp = link_blk(root); bp != NULL && bp->links.right != 0; bp = link_blk(bp->links.right))
+        ;
+    if (bp != NULL)
+        stats->largest_free = blk_size(bp) * WSIZE;
+}
+
+#else /* FREE_INDEX_BTREE */
+/*
+ * The B+tree keeps its nodes, two cache lines each, in an arena of their
+ * own outside the heap.  A node's keys (block sizes in words) fill its
+ * first line, so a search reads one line per level and compares all of
+ * a node's keys at once, without branches.  Inner node slot i leads to
+ * the sizes below key[i] (and at or above key[i-1]); leaf slot i is the
+ * list of free blocks of size key[i], linked through links.left (the
+ * previous block) and links.next.  A node that loses its last key is
+ * freed, but nodes are not merged, so some may run below half full.
+ */
+#define BT_KEYS      15             /* keys per node */
+#define BT_DEPTH     16             /* deeper than any tree we build */
+#ifndef BT_ARENA
+#define BT_ARENA     (64 << 20)     /* bytes reserved for nodes */
+#endif
+#define BT_NONE      UINT32_MAX     /* the key of an unused slot */
+
+struct bt_node {
+    uint16_t nkeys;
+    uint16_t leaf;
+    uint32_t key[BT_KEYS];          /* ascending, then BT_NONE */
+    uint32_t slot[BT_KEYS + 1];     /* children, or in a leaf, the list of each key */
+};
+
+static mem_heap_t *bt_arena;
+static char *bt_base;               /* start of the arena */
+static uint32_t bt_root;            /* nodes are numbered from the start of the arena */
+static uint32_t bt_free;            /* freed nodes, chained through slot[0] */
+static size_t bt_nodes;             /* nodes in use */
+static int bt_full;                 /* the arena ran out; only freed nodes are left */
+
+static struct bt_node *bt(uint32_t n) {
+    return (struct bt_node *)(bt_base + (size_t)n * sizeof(struct bt_node));
+}
+
+/* number of keys in node less than size; every key is less than BT_NONE */
+static unsigned bt_below(struct bt_node *node, uint32_t size)
+{
+    unsigned i, below = 0;
+
+    for (i = 0; i < BT_KEYS; i++)
+        below += node->key[i] < size;
+    return below;
+}
+
+/* a new, empty node, or 0 if the arena is full */
+static uint32_t bt_alloc(int leaf)
+{
+    uint32_t n = bt_free;
+    char *p;
+
+    if (n != 0)
+        bt_free = bt(n)->slot[0];
+    else if (bt_full || (p = mem_heap_sbrk(bt_arena, sizeof(struct bt_node))) == NULL) {
+        bt_full = 1;
+        return 0;
+    } else
+        n = (p - bt_base) / sizeof(struct bt_node);
+    bt(n)->nkeys = 0;
+    bt(n)->leaf = leaf;
+    memset(bt(n)->key, 0xff, sizeof(bt(n)->key));
+    bt_nodes++;
+    return n;
+}
+
+static void bt_release(uint32_t n)
+{
+    bt(n)->slot[0] = bt_free;
+    bt_free = n;
+    bt_nodes--;
+}
+
+/* descend to the leaf for size, recording the path */
+static uint32_t bt_descend(uint32_t size, uint32_t *path, unsigned *pos, unsigned *depth)
+{
+    uint32_t n = bt_root;
+    struct bt_node *node;
+
+    *depth = 0;
+    while (!(node = bt(n))->leaf) {
+        path[*depth] = n;
+        pos[*depth] = bt_below(node, size + 1);
+        n = node->slot[pos[(*depth)++]];
+    }
+    return n;
+}
+
+/* an empty tree; MEM_RESERVE rounds to 2MB, so a smaller (test) arena is malloc'd */
+static int index_init(void)
+{
+    if (bt_arena == NULL &&
+        (bt_arena = mem_heap_create(BT_ARENA, BT_ARENA >= MEM_HUGE_PAGE_SIZE ? MEM_RESERVE : 0)) == NULL)
+        return -1;
+    mem_heap_reset(bt_arena);
+    bt_base = mem_heap_lo_of(bt_arena);
+    bt_free = 0;
+    bt_nodes = 0;
+    bt_full = 0;
+    if (mem_heap_sbrk(bt_arena, sizeof(struct bt_node)) == NULL)     /* node 0 is none */
+        return -1;
+    return (bt_root = bt_alloc(1)) != 0 ? 0 : -1;
+}
+
+/*
+ * index_insert - add bp to the list of its size, after the first block,
+ *    or else add its size to a leaf, splitting full nodes on the way up.
+ *    The nodes a split needs are taken before anything moves.  The
+ *    arena holds far more nodes than a heap that links can reach has
+ *    sizes, but if it fills up anyway, bp is marked BT_NONE in its
+ *    parent link and left out of the index.
+ */
+static void index_insert(struct block *bp)
+{
+    uint32_t size = bp->header.size, key = size, val = blk_link(bp);
+    uint32_t path[BT_DEPTH], n, r, keys[BT_KEYS + 1], slots[BT_KEYS + 2];
+    uint32_t spare[BT_DEPTH + 1];
+    unsigned pos[BT_DEPTH], depth, i, j, nslots, nspare, half = (BT_KEYS + 1) / 2;
+    struct bt_node *node, *right;
+
+    bp->links.left = bp->links.next = bp->links.parent = 0;
+    n = bt_descend(size, path, pos, &depth);
+    node = bt(n);
+    i = bt_below(node, size);
+    if (i < node->nkeys && node->key[i] == size) {
+        struct block *head = link_blk(node->slot[i]), *next = link_blk(head->links.next);
+
+        bp->links.left = node->slot[i];
+        bp->links.next = head->links.next;
+        if (next != NULL)
+            next->links.left = val;
+        head->links.next = val;
+        return;
+    }
+
+    /* one node for each full node from the leaf up, and a new root if they all are */
+    for (nspare = 0; nspare <= depth && bt(nspare ? path[depth - nspare] : n)->nkeys == BT_KEYS; )
+        nspare++;
+    if (nspare > depth)
+        nspare++;
+    for (j = 0; j < nspare; j++)
+        if ((spare[j] = bt_alloc(0)) == 0) {
+            while (j > 0)
+                bt_release(spare[--j]);
+            bp->links.parent = BT_NONE;
+            return;
+        }
+
+    for (;;) {
+        /* key goes in at i; its list or the child to its right at j */
+        j = node->leaf ? i : i + 1;
+        nslots = node->leaf ? node->nkeys : node->nkeys + 1;
+        if (node->nkeys < BT_KEYS) {
+            memmove(&node->key[i + 1], &node->key[i], (node->nkeys - i) * sizeof(uint32_t));
+            memmove(&node->slot[j + 1], &node->slot[j], (nslots - j) * sizeof(uint32_t));
+            node->key[i] = key;
+            node->slot[j] = val;
+            node->nkeys++;
+            return;
+        }
+
+        /* split a full node: the upper half moves to a new right sibling */
+        r = spare[--nspare];
+        right = bt(r);
+        right->leaf = node->leaf;
+        memcpy(keys, node->key, i * sizeof(uint32_t));
+        keys[i] = key;
+        memcpy(&keys[i + 1], &node->key[i], (BT_KEYS - i) * sizeof(uint32_t));
+        memcpy(slots, node->slot, j * sizeof(uint32_t));
+        slots[j] = val;
+        memcpy(&slots[j + 1], &node->slot[j], (nslots - j) * sizeof(uint32_t));
+        memset(node->key, 0xff, sizeof(node->key));
+        memcpy(node->key, keys, half * sizeof(uint32_t));
+        node->nkeys = half;
+        key = keys[half];
+        if (node->leaf) {       /* the separator stays, as the right leaf's first key */
+            memcpy(node->slot, slots, half * sizeof(uint32_t));
+            memcpy(right->key, &keys[half], (BT_KEYS + 1 - half) * sizeof(uint32_t));
+            memcpy(right->slot, &slots[half], (BT_KEYS + 1 - half) * sizeof(uint32_t));
+            right->nkeys = BT_KEYS + 1 - half;
+        } else {                /* the separator moves up */
+            memcpy(node->slot, slots, (half + 1) * sizeof(uint32_t));
+            memcpy(right->key, &keys[half + 1], (BT_KEYS - half) * sizeof(uint32_t));
+            memcpy(right->slot, &slots[half + 1], (BT_KEYS + 1 - half) * sizeof(uint32_t));
+            right->nkeys = BT_KEYS - half;
+        }
+        val = r;
+
+        if (depth == 0) {       /* grow a new root */
+            r = spare[--nspare];
+            bt(r)->key[0] = key;
+            bt(r)->slot[0] = n;
+            bt(r)->slot[1] = val;
+            bt(r)->nkeys = 1;
+            bt_root = r;
+            return;
+        }
+        n = path[--depth];
+        node = bt(n);
+        i = pos[depth];
+    }
+}
+
+/*
+ * index_remove - unlink bp from the list of its size.  If it was the
+ *    last block of that size, drop the size from its leaf and free any
+ *    node left empty.
+ */
+static void index_remove(struct block *bp)
+{
+    uint32_t path[BT_DEPTH], n, size = bp->header.size;
+    unsigned pos[BT_DEPTH], depth, i;
+    struct bt_node *node;
+    struct block *next = link_blk(bp->links.next);
+    bool empty;
+
+    if (bp->links.parent == BT_NONE)    /* never indexed */
+        return;
+    if (bp->links.left != 0) {
+        link_blk(bp->links.left)->links.next = bp->links.next;
+        if (next != NULL)
+            next->links.left = bp->links.left;
+        return;
+    }
+
+    n = bt_descend(size, path, pos, &depth);
+    node = bt(n);
+    i = bt_below(node, size);
+    assert(i < node->nkeys && node->slot[i] == blk_link(bp));
+    if (next != NULL) {
+        next->links.left = 0;
+        node->slot[i] = bp->links.next;
+        return;
+    }
+    memmove(&node->key[i], &node->key[i + 1], (node->nkeys - i - 1) * sizeof(uint32_t));
+    memmove(&node->slot[i], &node->slot[i + 1], (node->nkeys - i - 1) * sizeof(uint32_t));
+    node->key[--node->nkeys] = BT_NONE;
+
+    for (empty = node->nkeys == 0; empty && depth > 0; ) {
+        bt_release(n);
+        n = path[--depth];
+        node = bt(n);
+        if (node->nkeys == 0)   /* that was its only child */
+            continue;
+        i = pos[depth];
+        memmove(&node->key[i ? i - 1 : 0], &node->key[i ? i : 1],
+                (node->nkeys - (i ? i : 1)) * sizeof(uint32_t));
+        memmove(&node->slot[i], &node->slot[i + 1], (node->nkeys - i) * sizeof(uint32_t));
+        node->key[--node->nkeys] = BT_NONE;
+        empty = false;
+    }
+    if (empty)                  /* the root lost its last size */
+        node->leaf = 1;
+    while (!(node = bt(bt_root))->leaf && node->nkeys == 0) {
+        n = bt_root;
+        bt_root = node->slot[0];
+        bt_release(n);
+    }
+}
+
+/* Of several blocks of the best size, take one after the first, which
+   leaves the leaf as it is */
+static struct block *index_fit(size_t asize)
+{
+    uint32_t path[BT_DEPTH], n;
+    unsigned pos[BT_DEPTH], depth, i;
+    struct bt_node *node;
+    struct block *bp;
+
+    if (asize >= BT_NONE / 2)
+        return NULL;
+    n = bt_descend(asize, path, pos, &depth);
+    node = bt(n);
+    i = bt_below(node, asize);
+    if (i == node->nkeys) {
+        /* nothing here: take the first size of the next subtree */
+        do {
+            if (depth == 0)
+                return NULL;
+            --depth;
+            node = bt(path[depth]);
+        } while (pos[depth] + 1 > node->nkeys);
+        n = node->slot[pos[depth] + 1];
+        while (!(node = bt(n))->leaf)
+            n = node->slot[0];
+        i = 0;
+    }
+    bp = link_blk(node->slot[i]);
+    if (bp->links.next != 0)
+        bp = link_blk(bp->links.next);
+    return bp;
+}
+
+/* add the free blocks under node n to stats */
+static void stats_walk(uint32_t n, struct mm_heapstats *stats)
+{
+    struct bt_node *node = bt(n);
+    struct block *bp;
+    unsigned i;
+
+    if (!node->leaf) {
+        for (i = 0; i <= node->nkeys; i++)
+            stats_walk(node->slot[i], stats);
+        return;
+    }
+    stats->index_nodes += node->nkeys;
+    for (i = 0; i < node->nkeys; i++)
+        for (bp = link_blk(node->slot[i]); bp != NULL; bp = link_blk(bp->links.next)) {
+            stats->free_blocks++;
+            stats->free_bytes += blk_size(bp) * WSIZE;
+        }
+}
+
+static void index_stats(struct mm_heapstats *stats)
+{
+    struct bt_node *node;
+
+    stats_walk(bt_root, stats);
+    for (node = bt(bt_root); !node->leaf; node = bt(node->slot[node->nkeys]))
+        ;
+    if (node->nkeys > 0)
+        stats->largest_free = node->key[node->nkeys - 1] * WSIZE;
+    stats->index_bytes = bt_nodes * sizeof(struct bt_node);
+}
+#endif /* FREE_INDEX_SPLAY, FREE_INDEX_BTREE */
+
+/*
+ * The small-size index in front of it.  Block sizes are even numbers of
+ * words, so size s up to SMALL_WORDS has list s / 2.  Bit i of
+ * small_map[j] is set when list 32 * j + i has blocks, and bit j of
+ * small_summary when small_map[j] is not zero.  The lists are kept like
+ * the index's: a new block goes after the first one of its size, and a
+ * fit takes the block after the first if there is one, so a request
+ * gets the same block whichever index holds its size.
+ */
+#ifndef SMALL_WORDS
+#define SMALL_WORDS  1024                       /* largest size kept here; 0 for none */
+#endif
+#define SMALL_LISTS  (SMALL_WORDS / 2 + 1)
+#define SMALL_MAPS   ((SMALL_LISTS + 31) / 32)
+
+static uint32_t small_head[SMALL_LISTS];        /* first block of each size */
+static uint32_t small_map[SMALL_MAPS];
+static uint32_t small_summary;
+
+static void small_insert(struct block *bp)
+{
+    unsigned i = bp->header.size / 2;
+    uint32_t val = blk_link(bp);
+    struct block *head = link_blk(small_head[i]), *next;
+
+    bp->links.left = bp->links.next = 0;
+    if (head == NULL) {
+        small_head[i] = val;
+        small_map[i / 32] |= 1u << (i % 32);
+        small_summary |= 1u << (i / 32);
+        return;
+    }
+    bp->links.left = small_head[i];
+    bp->links.next = head->links.next;
+    if ((next = link_blk(head->links.next)) != NULL)
+        next->links.left = val;
+    head->links.next = val;
+}
+
+static void small_remove(struct block *bp)
+{
+    unsigned i = bp->header.size / 2;
+    struct block *next = link_blk(bp->links.next);
+
+    if (bp->links.left != 0) {
+        link_blk(bp->links.left)->links.next = bp->links.next;
+        if (next != NULL)
+            next->links.left = bp->links.left;
+    } else if (next != NULL) {
+        next->links.left = 0;
+        small_head[i] = bp->links.next;
+    } else {
+        small_head[i] = 0;
+        if ((small_map[i / 32] &= ~(1u << (i % 32))) == 0)
+            small_summary &= ~(1u << (i / 32));
+    }
+}
+
+/* the smallest size of at least asize words that has free blocks, or NULL */
+static struct block *small_fit(size_t asize)
+{
+    unsigned i = asize / 2, j = i / 32;
+    uint32_t bits = small_map[j] & (~0u << (i % 32)), above;
+    struct block *bp;
+
+    if (bits == 0) {
+        above = j + 1 < SMALL_MAPS ? small_summary & (~0u << (j + 1)) : 0;
+        if (above == 0)
+            return NULL;
+        j = __builtin_ctz(above);
+        bits = small_map[j];
+    }
+    bp = link_blk(small_head[32 * j + __builtin_ctz(bits)]);
+    if (bp->links.next != 0)
+        bp = link_blk(bp->links.next);
+    return bp;
+}
+
+static void small_stats(struct mm_heapstats *stats)
+{
+    struct block *bp;
+    unsigned i;
+
+    for (i = 0; i < SMALL_LISTS; i++) {
+        if (small_head[i] == 0)
+            continue;
+        stats->index_nodes++;
+        for (bp = link_blk(small_head[i]); bp != NULL; bp = link_blk(bp->links.next)) {
+            stats->free_blocks++;
+            stats->free_bytes += blk_size(bp) * WSIZE;
+        }
+        if (stats->largest_free < 2 * i * WSIZE)
+            stats->largest_free = 2 * i * WSIZE;
+    }
+}
+
 /* 
  * The remaining routines are internal helper routines 
  */
@@ -234,8 +1237,12 @@ static struct block *extend_heap(size_t words)
 
     /* Allocate an even number of words to maintain alignment */
     words = (words + 1) & ~1;
+    if ((mem_heapsize() + words * WSIZE) / DSIZE >= LINK_MASK)    /* beyond what links reach */
+        return NULL;
     if ((long)(bp = mem_sbrk(words * WSIZE)) == -1)  
         return NULL;
+    if (config.stats)
+        counts.growths++;
 
     /* Initialize free block header/footer and the epilogue header.
      * Note that we scoop up the previous epilogue here. */
@@ -247,17 +1254,404 @@ static struct block *extend_heap(size_t words)
     return coalesce(blk);
 }
 
+/*
+ * growth_words - Decide how far to extend the heap when it lacks need
+ *    words.  Growths that come in quick succession double the extra
+ *    words we add, up to config.growth_slack percent of the heap;
+ *    spaced-out growths halve it again.  With no slack, grow exactly.
+ */
+static size_t growth_words(size_t need)
+{
+    size_t cap = mem_heapsize() / WSIZE * config.growth_slack / 100;
+
+    if (allocs_since_grow < config.growth_window)
+        grow_extra = grow_extra ? 2 * grow_extra : config.chunk;
+    else
+        grow_extra /= 2;
+    allocs_since_grow = 0;
+    if (grow_extra > cap)
+        grow_extra = cap;
+    return need + grow_extra;
+}
+
+/*
+ * extend_last_block - Grow blk, the used block at the end of the heap,
+ *    in place to words words.  If the growth policy extends the heap
+ *    further, the rest becomes a free block after blk.
+ */
+static struct block *extend_last_block(struct block *blk, size_t words)
+{
+    size_t total;
+
+    if (extend_heap(growth_words(words - blk_size(blk))) == NULL)
+        return NULL;
+    total = blk_size(blk) + blk_size(next_blk(blk));
+    if (total - words >= config.split) {
+        mark_block_used(blk, words);
+        mark_block_free(next_blk(blk), total - words);
+        add_free_block(next_blk(blk));
+    }
+    else
+        mark_block_used(blk, total);
+    return blk;
+}
+
+#ifdef THREAD_SAFE
+/*
+ * Per-thread slabs for small blocks.
+ */
+#define LINE_SIZE        64     /* cache line size, in bytes */
+#define SLAB_BYTES     1024     /* line-aligned bytes in a slab */
+#define SLAB_MAX_PAYLOAD 60     /* largest request served from a slab */
+#define SLAB_CLASSES      7     /* size classes 0..6: slots of 16, 24, ..., 64 bytes */
+
+struct slab_cache;
+
+/* The header at the (line-aligned) start of each slab */
+struct slab {
+    struct slab_cache *owner;   /* only this thread allocates from the slab */
+    struct slab *prev, *next;   /* in the owner's list of slabs with free slots */
+    void *free;                 /* free slots, linked through their payloads */
+    int nfree, nslots;
+    int slot;                   /* slot size in bytes, tag included */
+    void *blk;                  /* payload of the block holding the slab */
+};
+
+/* A thread's slabs that have free slots, one list per slot size */
+struct slab_cache {
+    struct slab *slabs[SLAB_CLASSES];
+    struct slab_cache *next_orphan; /* on the orphans list once its thread exited */
+    unsigned epoch;
+};
+
+/* Offset of the first slot's tag.  Payloads start on the line after the
+   header, which any thread's slab_free writes, so no live object shares
+   a line with it; the tags in front of them are only ever read. */
+#define SLAB_FIRST_SLOT (LINE_SIZE - WSIZE)
+
+/* mm_init empties the heap and with it every slab; threads notice that
+   their cache is from an older heap by its epoch */
+static unsigned slab_epoch;
+static struct slab_cache *orphans;      /* caches of threads that exited */
+static __thread struct slab_cache *my_cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * slab_orphan - thread exit: leave the thread's slabs for the next new
+ *     thread to adopt, so short-lived threads do not each strand a set
+ */
+static void slab_orphan(void *arg)
+{
+    struct slab_cache *cache = arg;
+
+    pthread_mutex_lock(&malloc_lock);
+    if (cache->epoch == slab_epoch) {
+        cache->next_orphan = orphans;
+        orphans = cache;
+    }
+    pthread_mutex_unlock(&malloc_lock);
+}
+
+static void make_cache_key(void)
+{
+    pthread_key_create(&cache_key, slab_orphan);
+}
+
+/* the calling thread's slab cache: its own, an orphan, or a new one */
+static struct slab_cache *slab_cache(void)
+{
+    struct slab_cache *cache = my_cache;
+
+    if (cache != NULL && cache->epoch == slab_epoch)
+        return cache;
+    if (orphans != NULL) {
+        cache = orphans;
+        orphans = cache->next_orphan;
+    } else {
+        if ((cache = alloc_block(sizeof(struct slab_cache))) == NULL)
+            return NULL;
+        memset(cache, 0, sizeof(*cache));
+        cache->epoch = slab_epoch;
+    }
+    pthread_once(&cache_key_once, make_cache_key);
+    pthread_setspecific(cache_key, cache);
+    my_cache = cache;
+    return cache;
+}
+
+static void slab_link(struct slab *s, int cls)
+{
+    struct slab **head = &s->owner->slabs[cls];
+
+    s->prev = NULL;
+    s->next = *head;
+    if (*head != NULL)
+        (*head)->prev = s;
+    *head = s;
+}
+
+static void slab_unlink(struct slab *s, int cls)
+{
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        s->owner->slabs[cls] = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+}
+
+/*
+ * slab_create - carve a new slab of slot-byte slots for cache out of
+ *     an ordinary block, lining it up with the cache lines
+ */
+static struct slab *slab_create(struct slab_cache *cache, int cls)
+{
+    char *blk = alloc_block(SLAB_BYTES + LINE_SIZE - DSIZE);
+    struct slab *s;
+    char *slot;
+    int i;
+
+    assert(sizeof(struct slab) <= SLAB_FIRST_SLOT);
+    if (blk == NULL)
+        return NULL;
+    s = (struct slab *)(((uintptr_t)blk + LINE_SIZE - 1) & ~(uintptr_t)(LINE_SIZE - 1));
+    s->owner = cache;
+    s->blk = blk;
+    s->slot = sc_class_size[cls];
+    s->nslots = s->nfree = (SLAB_BYTES - SLAB_FIRST_SLOT) / s->slot;
+    s->free = NULL;
+    slot = (char *)s + SLAB_FIRST_SLOT + (s->nslots - 1) * s->slot;
+    for (i = 0; i < s->nslots; i++, slot -= s->slot) {
+        struct boundary_tag *tag = (struct boundary_tag *)slot;
+        tag->inuse = 1;
+        tag->size = -(int)((slot - (char *)s) / WSIZE);
+        *(void **)(tag + 1) = s->free;
+        s->free = tag + 1;
+    }
+    slab_link(s, cls);
+    return s;
+}
+
+/* the slab a slot's payload belongs to */
+static struct slab *slab_of(void *ptr)
+{
+    struct boundary_tag *tag = (struct boundary_tag *)ptr - 1;
+    return (struct slab *)((char *)tag + tag->size * WSIZE);
+}
+
+/*
+ * slab_malloc - allocate size bytes from one of the calling thread's slabs
+ */
+static void *slab_malloc(size_t size)
+{
+    int cls = sc_small_class[size + WSIZE];
+    struct slab_cache *cache;
+    struct slab *s;
+    void *p;
+
+    if ((cache = slab_cache()) == NULL)
+        return NULL;
+    if ((s = cache->slabs[cls]) == NULL && (s = slab_create(cache, cls)) == NULL)
+        return NULL;
+    p = s->free;
+    s->free = *(void **)p;
+    if (--s->nfree == 0)
+        slab_unlink(s, cls);
+    return p;
+}
+
+/*
+ * slab_free - return a slot to its slab, whichever thread frees it.  An
+ *     empty slab goes back to the heap unless it is its owner's last one.
+ */
+static void slab_free(void *ptr)
+{
+    struct slab *s = slab_of(ptr);
+    int cls = sc_small_class[s->slot];
+
+    *(void **)ptr = s->free;
+    s->free = ptr;
+    if (s->nfree++ == 0)
+        slab_link(s, cls);
+    if (s->nfree == s->nslots && (s->prev != NULL || s->next != NULL)) {
+        slab_unlink(s, cls);
+        free_nostats(s->blk);
+    }
+}
+
+/*
+ * slab_realloc - resize a slot's payload; it stays put while it fits
+ */
+static void *slab_realloc(void *ptr, size_t size)
+{
+    size_t payload = slab_of(ptr)->slot - WSIZE;
+    void *newptr;
+
+    if (size <= payload)
+        return ptr;
+    if ((newptr = malloc_nostats(size)) == NULL)
+        return NULL;
+    memcpy(newptr, ptr, payload);
+    slab_free(ptr);
+    return newptr;
+}
+#endif /* THREAD_SAFE */
+
+/*
+ * extend_huge_aligned - Extend the heap with a used block of awords
+ *     words whose payload starts on a huge page boundary.  The gap in
+ *     front of it (merged with any free block at the end of the heap)
+ *     becomes a free block.
+ */
+static struct block *extend_huge_aligned(size_t awords)
+{
+    char *end = (char *)mem_heap_hi() + 1 - sizeof(FENCE);  /* epilogue */
+    char *payload = (char *)(((uintptr_t)end + sizeof(FENCE) + MEM_HUGE_PAGE_SIZE - 1)
+                             & ~(uintptr_t)(MEM_HUGE_PAGE_SIZE - 1));
+    size_t gap = payload - sizeof(FENCE) - end;
+    struct block *bp, *blk;
+    size_t front;
+
+    if (gap > 0 && gap < MIN_BLOCK_SIZE_WORDS * WSIZE) {
+        payload += MEM_HUGE_PAGE_SIZE;
+        gap += MEM_HUGE_PAGE_SIZE;
+    }
+    if ((bp = extend_heap(gap / WSIZE + awords)) == NULL)
+        return NULL;
+
+    blk = (struct block *)(payload - offsetof(struct block, payload));
+    front = ((char *)blk - (char *)bp) / WSIZE;
+    if (front > 0) {
+        mark_block_used(blk, blk_size(bp) - front);
+        mark_block_free(bp, front);
+        add_free_block(bp);
+    } else {
+        mark_block_used(blk, blk_size(bp));
+    }
+    return blk;
+}
+
+/*
+ * print_stats - at exit, report the call counts kept with stats:1
+ *    since the last mm_init
+ */
+static void print_stats(void)
+{
+    int i;
+
+    fprintf(stderr, "mm: %lu mallocs (%lu from slabs), %lu frees, %lu reallocs, "
+            "%lu heap growths, %zu heap bytes\n", counts.mallocs, counts.slab_mallocs,
+            counts.frees, counts.reallocs, counts.growths, mem_heapsize());
+    fprintf(stderr, "mm: mallocs by size class:");
+    for (i = 0; i < SC_NCLASSES; i++)
+        if (counts.classes[i] > 0)
+            fprintf(stderr, " %u:%lu", sc_class_size[i], counts.classes[i]);
+    fprintf(stderr, "\n");
+}
+
+/*
+ * read_options - Set config to the defaults, then apply MM_OPTIONS, a
+ *    comma-separated list of key:value pairs such as
+ *
+ *        MM_OPTIONS=chunk:4096,slack:25,stats:1
+ *
+ *    Sizes are in bytes.  The keys are chunk, split, slack (percent),
+ *    window (allocations), div and hits (the profiler), slab_max and
+ *    stats (0 or 1).  Values are unsigned decimal numbers.  Bad or
+ *    unknown options are reported and skipped.
+ */
+static void read_options(void)
+{
+    static const struct { const char *key; size_t *value; size_t scale; } keys[] = {
+        { "chunk",    &config.chunk,         WSIZE },
+        { "split",    &config.split,         WSIZE },
+        { "slack",    &config.growth_slack,  1 },
+        { "window",   &config.growth_window, 1 },
+        { "div",      &config.profile_div,   1 },
+        { "hits",     &config.profile_hits,  1 },
+        { "slab_max", &config.slab_max,      1 },
+    };
+    const char *opt = getenv("MM_OPTIONS"), *colon;
+    char key[16], *end;
+    unsigned long value;
+    size_t i, len;
+
+    config.chunk = CHUNKSIZE;
+    config.split = MIN_BLOCK_SIZE_WORDS;
+    config.growth_slack = GROWTH_SLACK;
+    config.growth_window = GROWTH_WINDOW;
+    config.profile_div = DIV;
+    config.profile_hits = PT;
+#ifdef THREAD_SAFE
+    config.slab_max = SLAB_MAX_PAYLOAD;
+#endif
+    config.stats = false;
+
+    /* one key:value entry up to each comma; the value is decimal digits only */
+    for (; opt != NULL && *opt != '\0'; opt += len + (opt[len] == ',')) {
+        len = strcspn(opt, ",");
+        colon = memchr(opt, ':', len);
+        end = NULL;
+        errno = 0;
+        if (colon != NULL && colon > opt && colon - opt < (long)sizeof(key) &&
+            isdigit((unsigned char)colon[1]))
+            value = strtoul(colon + 1, &end, 10);
+        if (end != opt + len || errno != 0) {
+            fprintf(stderr, "mm: bad MM_OPTIONS entry \"%.*s\" skipped\n", (int)len, opt);
+            continue;
+        }
+        memcpy(key, opt, colon - opt);
+        key[colon - opt] = '\0';
+        for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+            if (strcmp(key, keys[i].key) == 0)
+                break;
+        if (i < sizeof(keys) / sizeof(keys[0]))
+            *keys[i].value = (value + keys[i].scale - 1) / keys[i].scale;
+        else if (strcmp(key, "stats") == 0)
+            config.stats = value != 0;
+        else
+            fprintf(stderr, "mm: unknown MM_OPTIONS key \"%s\" ignored\n", key);
+    }
+
+    /* keep the values the heap's layout depends on in range */
+    config.chunk = MAX((config.chunk + 1) & ~1, MIN_BLOCK_SIZE_WORDS);
+    config.split = MAX(config.split, MIN_BLOCK_SIZE_WORDS);
+#ifdef THREAD_SAFE
+    if (config.slab_max > SLAB_MAX_PAYLOAD)
+        config.slab_max = SLAB_MAX_PAYLOAD;
+#endif
+    if (config.stats)
+        atexit(print_stats);
+}
+
 /**
  * intialize the memory 
  */
 int mm_init (void) {
-    RB_INIT(&tree);
+    static pthread_once_t options_once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&options_once, read_options);
+    memset(&counts, 0, sizeof(counts));
+#ifdef THREAD_SAFE
+    slab_epoch++;
+    orphans = NULL;
+#endif
     struct boundary_tag * initial = mem_sbrk(2 * sizeof(struct boundary_tag));
     if (initial == (void *)-1)
         return -1;
-    first = DIV;
-    second = DIV - 2;
+    heap_base = mem_heap_lo();
+    assert(((uintptr_t)heap_base & (DSIZE - 1)) == 0);
+    if (index_init() < 0)
+        return -1;
+    memset(small_head, 0, sizeof(small_head));
+    memset(small_map, 0, sizeof(small_map));
+    small_summary = 0;
+    first = config.profile_div;
+    second = config.profile_div - 2;
     first_timer = second_timer = 0;
+    grow_extra = 0;
+    allocs_since_grow = config.growth_window;
     /* We use a slightly different strategy than suggested in the book.
      * Rather than placing a min-sized prologue block at the beginning
      * of the heap, we simply place two fences.
@@ -268,7 +1662,7 @@ int mm_init (void) {
     initial[0] = FENCE;                     /* Prologue footer */
     initial[1] = FENCE;
     struct block * blk = (struct block*)&initial[1];
-    if (extend_heap(CHUNKSIZE) == NULL)  {
+    if (extend_heap(config.chunk) == NULL)  {
         return -1;
     }
     add_free_block(blk);
@@ -280,79 +1674,34 @@ int mm_init (void) {
  */
 static struct block *find_fit(size_t asize)
 {
-    struct block temp; 
-    temp.header.size = asize;
+    struct block *bp = NULL;
+
+    if (asize <= SMALL_WORDS)
+        bp = small_fit(asize);
+    if (bp == NULL)
+        bp = index_fit(asize);
 
-    struct block *bp = RB_NFIND(rb_tree, &tree, &temp);
-    if (bp != NULL) remove_free_block(bp);
+    if (bp != NULL)
+        remove_free_block(bp);
     return bp;
 }
 
 static void add_free_block(struct block* bp) {
-
-    if (bp != 0) {
-
-        struct block* blk = RB_FIND(rb_tree, &tree, bp);
-
-        if (blk == NULL) {              //case 1: no duplicate
-
-            bp->prev = NULL;
-            bp->next = NULL;
-            RB_INSERT(rb_tree, &tree, bp);
-        }
-        else {
-            struct block* next = blk->next;
-            if (next != NULL) {         //case 2: with duplicates
-                next->prev = bp;       
-            }
-            bp->next = next;
-            blk->next = bp;
-            bp->prev = blk;
-        }
-    }
-    return;
+    if (bp == 0)
+        return;
+    if (bp->header.size <= SMALL_WORDS)
+        small_insert(bp);
+    else
+        index_insert(bp);
 }
 
 static void remove_free_block(struct block* bp) {
-
-    if (bp != 0) {
-
-        if (bp->prev != NULL) {                 //case1: current block is in a duplicate list, but not the first node
-            if (bp->next != NULL) {
-
-                bp->next->prev = bp->prev;
-                bp->prev->next = bp->next;
-                bp->prev = NULL;
-                bp->next = NULL;
-                //bp->elem.node = NULL;
-                return;
-            }
-
-            bp->prev->next = NULL;
-            bp->prev = NULL;
-            //bp->elem.node = NULL;
-            return;
-        }
-        else {                                  //case2: current block is in a duplicate list, and it has nodes in its next
-            if (bp->next != NULL) {
-                struct block* blk = bp->next;
-
-                blk->prev = NULL;
-                bp->next = NULL;
-                //bp->elem.node = NULL;
-
-                RB_REMOVE(rb_tree, &tree, bp);
-                RB_INSERT(rb_tree, &tree, blk);
-
-                return;
-            }
-
-            //bp->elem.node = NULL;             //case3: current block is a lonely child
-            RB_REMOVE(rb_tree, &tree, bp);
-            return;
-        }
-    }
-    return;
+    if (bp == 0)
+        return;
+    if (bp->header.size <= SMALL_WORDS)
+        small_remove(bp);
+    else
+        index_remove(bp);
 }
 
 /* 
@@ -364,7 +1713,7 @@ static void place(struct block *bp, size_t asize)
     size_t csize = blk_size(bp);
     //printf("placing a size into the table size %d\n", asize);
 
-    if ((csize - asize) >= MIN_BLOCK_SIZE_WORDS) { 
+    if ((csize - asize) >= config.split) { 
         mark_block_used(bp, asize);
         bp = next_blk(bp); 
         mark_block_free(bp, csize-asize);
@@ -379,14 +1728,32 @@ static void place(struct block *bp, size_t asize)
  * allocate a chunk of memory from map.
  */
 void *mm_malloc (size_t size) {
-    size_t awords;      /* Adjusted block size in words */
-    size_t extendwords;  /* Amount to extend heap if no fit */
-    struct block *bp;      
-
     /* Ignore spurious requests */
     if (size == 0)
         return NULL;
 
+    if (config.stats) {
+        counts.mallocs++;
+        counts.classes[size <= SC_MAX ? sc_class(size) : SC_NCLASSES - 1]++;
+#ifdef THREAD_SAFE
+        if (size <= config.slab_max)
+            counts.slab_mallocs++;
+#endif
+    }
+    return malloc_nostats(size);
+}
+
+/*
+ * malloc_nostats - mm_malloc without the stats, for the calls the
+ *    allocator makes itself, so that a realloc counts only as a realloc
+ */
+static void *malloc_nostats(size_t size)
+{
+#ifdef THREAD_SAFE
+    if (size <= config.slab_max)
+        return slab_malloc(size);
+#endif
+
     /*profiling*/
     if (size == first + second);
     else {
@@ -400,22 +1767,51 @@ void *mm_malloc (size_t size) {
             second = size;
             second_timer = 0;
         }
-        if (first_timer >= PT && second_timer >= PT) {
+        if (first_timer >= config.profile_hits && second_timer >= config.profile_hits) {
             if (size == first)
                 size += second;
         }
     }
+    return alloc_block(size);
+}
 
-    /* Adjust block size to include overhead and alignment reqs. */
+/*
+ * block_bytes - bytes in a block with room for size bytes: the size plus
+ *    its tags, rounded to a double word.  Small sizes look the rounding up
+ *    in the size-class table, whose classes are DSIZE apart.
+ */
+static inline size_t block_bytes(size_t size)
+{
     size += 2 * sizeof(struct boundary_tag);    /* account for tags */
-    size = (size + DSIZE - 1) & ~(DSIZE - 1);   /* align to double word */
+    if (size <= SC_SMALL_MAX)
+        return sc_round(size);
+    return (size + DSIZE - 1) & ~(DSIZE - 1);   /* align to double word */
+}
+
+/*
+ * alloc_block - allocate an ordinary block with room for size bytes
+ */
+static void *alloc_block(size_t size)
+{
+    size_t awords;      /* Adjusted block size in words */
+    size_t extendwords;  /* Amount to extend heap if no fit */
+    struct block *bp;      
+
+    /* Adjust block size to include overhead and alignment reqs. */
+    size = block_bytes(size);
     awords = MAX(MIN_BLOCK_SIZE_WORDS, size/WSIZE);                                   /* respect minimum size */
+    allocs_since_grow++;
     if ( (bp = find_fit(awords)) != NULL) {		/* if found a place for the block then place it*/
         //iassert(awords <= bp->header.size);
         place(bp, awords);
         return bp->payload;
     }
 
+    /* on a huge-page heap, start big blocks on a huge page so they
+       span no more TLB entries than they must */
+    if (awords * WSIZE >= MEM_HUGE_PAGE_SIZE && mem_hugepages())
+        return (bp = extend_huge_aligned(awords)) != NULL ? bp->payload : NULL;
+
     /* maximimze the coalesce utility*/
     struct boundary_tag* prev_boundary_tag = (struct boundary_tag*)(mem_heap_hi() - sizeof(struct boundary_tag) - PADDING);
     if (!prev_boundary_tag->inuse) {
@@ -425,11 +1821,11 @@ void *mm_malloc (size_t size) {
         extendwords = awords;
     }
 
-    if ((bp = extend_heap(extendwords)) == NULL)  
+    if ((bp = extend_heap(growth_words(extendwords))) == NULL)  
         return NULL;
     //mark_block_used(bp, bp->header.size);
     place(bp, awords);
-    //     print_tree(RB_ROOT(&tree));
+    //     print_tree(link_blk(root));
     return bp->payload;
 }
 
@@ -442,8 +1838,24 @@ void mm_free (void *ptr) {
     if (ptr == 0) 
         return;
 
+    if (config.stats)
+        counts.frees++;
+    free_nostats(ptr);
+}
+
+/*
+ * free_nostats - mm_free without the stats
+ */
+static void free_nostats(void *ptr)
+{
     /* Find block from user pointer */
     struct block *blk = ptr - offsetof(struct block, payload);
+#ifdef THREAD_SAFE
+    if (blk->header.size < 0) {
+        slab_free(ptr);
+        return;
+    }
+#endif
     mark_block_free(blk, blk_size(blk));
     struct block* newblk = coalesce(blk);
     add_free_block(newblk);
@@ -460,25 +1872,31 @@ void *mm_realloc(void *ptr, size_t size) {
     size_t oldsize;
     void *newptr;
     size_t raw_size = size;
+    if (config.stats)
+        counts.reallocs++;
     /* If size == 0 then this is just free, and we return NULL. */
     if(size == 0) {
-        mm_free(ptr);
+        if (ptr != NULL)
+            free_nostats(ptr);
         return 0;
     }
 
     /* If oldptr is NULL, then this is just malloc. */
     if(ptr == NULL) {
-        return mm_malloc(size);
+        return malloc_nostats(size);
     }
-    size += 2 * sizeof(struct boundary_tag);    /* account for tags */
-    size = (size + DSIZE - 1) & ~(DSIZE - 1);   /* align to double word */
+#ifdef THREAD_SAFE
+    if (((struct block *)(ptr - offsetof(struct block, payload)))->header.size < 0)
+        return slab_realloc(ptr, size);
+#endif
+    size = block_bytes(size);
     struct block *oldblock = ptr - offsetof(struct block, payload);
     oldsize = blk_size(oldblock)*WSIZE;   
     struct block * next = next_blk(oldblock);
     if (size <= oldsize) return ptr; 
     if (blk_free(next)) {                                           //case when the next block is free to use
         size_t temp = next->header.size*WSIZE;
-        if (temp + oldsize - size > WSIZE*MIN_BLOCK_SIZE_WORDS) {  //check if split is needed
+        if (temp + oldsize > size + WSIZE*config.split) {  //check if split is needed
 
             remove_free_block(next);
             mark_block_used(oldblock, size/WSIZE);
@@ -486,60 +1904,61 @@ void *mm_realloc(void *ptr, size_t size) {
             mark_block_free(next, temp/WSIZE + oldsize/WSIZE - size/WSIZE);
             add_free_block(next);
         }
-        else if (temp + oldsize-size >= 0) {                      //case when split is not needed
+        else if (temp + oldsize >= size) {                        //case when split is not needed
             remove_free_block(next);
             mark_block_used(oldblock, next->header.size + oldsize/4);
         }
         else if (next_blk(next)->header.size == 0) {              //check if the next block is the end of the heap, so we can request more memory to it.
+            size_t next_size = blk_size(next);
             remove_free_block(next);
-            extend_heap(size/WSIZE - oldsize/WSIZE - next->header.size);
-            remove_free_block(next);
-            mark_block_used(oldblock, size/WSIZE);
+            mark_block_used(oldblock, oldsize/WSIZE + next_size);   //absorb next first so extend_heap does not coalesce into it
+            if (extend_last_block(oldblock, size/WSIZE) == NULL)
+                return NULL;
         }
         else if (!prev_blk_footer(oldblock)->inuse && prev_blk_footer(oldblock)->size*WSIZE > 24  && prev_blk_footer(oldblock)->size*WSIZE + oldsize + temp > size ) {     //case when we can use space from the previous block and the next block
 
             remove_free_block(next);
             struct block* prev = prev_blk(oldblock);
             size_t prev_size = prev->header.size;
-            if (temp + oldsize + blk_size(prev) - size > WSIZE*MIN_BLOCK_SIZE_WORDS) {      //check if we need to split
+            if (temp + oldsize + prev_size*WSIZE > size + WSIZE*config.split) {      //check if we need to split
                 remove_free_block(prev);
-                memcpy(prev->payload, ptr, oldsize);
+                memmove(prev->payload, ptr, oldsize);
                 mark_block_used(prev, size/WSIZE); 
                 next = next_blk(prev);
                 mark_block_free(next, temp/WSIZE + oldsize/WSIZE+prev_size - size/WSIZE);
                 add_free_block(next);
                 return prev->payload;
             }
-            remove_free_block(prev);                                    //memcpy the old data to the previous block
-            memcpy(prev->payload, ptr, oldsize);
+            remove_free_block(prev);                                    //move the old data to the previous block
+            memmove(prev->payload, ptr, oldsize);
             mark_block_used(prev, temp/WSIZE + oldsize/WSIZE+prev_size);
             return prev->payload;
         }
         else {      //else ust call malloc
 
-            newptr = mm_malloc(raw_size);
+            newptr = malloc_nostats(raw_size);
             if (!newptr) return 0;
             if (size < oldsize) oldsize = size;
             memcpy(newptr, ptr, oldsize);
 
             /* Free the old block. */
-            mm_free(ptr);
+            free_nostats(ptr);
             return newptr;
         }
         return  ptr;
     }
     else if (next->header.size == 0) {      //case when the current block is the last block in the heap
-        extend_heap(size/WSIZE - oldsize/WSIZE);
-        mark_block_used(oldblock, size/WSIZE);
+        if (extend_last_block(oldblock, size/WSIZE) == NULL)
+            return NULL;
         return ptr;
     }
     else if (!prev_blk_footer(oldblock)->inuse && prev_blk_footer(oldblock)->size*WSIZE + oldsize > size) {     //case when the previous block can be used
         struct block* prev = prev_blk(oldblock);
         size_t prev_size = prev->header.size;
-        if (oldsize + blk_size(prev) - size > WSIZE*MIN_BLOCK_SIZE_WORDS) {
+        if (oldsize + prev_size*WSIZE > size + WSIZE*config.split) {
 
             remove_free_block(prev);
-            memcpy(prev->payload, ptr, oldsize);
+            memmove(prev->payload, ptr, oldsize);
             mark_block_used(prev, size/WSIZE);
             next = next_blk(prev);
             mark_block_free(next, oldsize/WSIZE+prev_size- size/WSIZE);
@@ -547,22 +1966,34 @@ void *mm_realloc(void *ptr, size_t size) {
             return prev->payload;
         }
         remove_free_block(prev);
-        memcpy(prev->payload, ptr, oldsize);
+        memmove(prev->payload, ptr, oldsize);
         mark_block_used(prev, oldsize/WSIZE+prev_size);
         return prev->payload;
     }
     else {                  //nothing can be used, call malloc
-        newptr = mm_malloc(raw_size);
+        newptr = malloc_nostats(raw_size);
         if (!newptr) return 0;
         if (size < oldsize) oldsize = size;
         memcpy(newptr, ptr, oldsize);
 
         /* Free the old block. */
-        mm_free(ptr);
+        free_nostats(ptr);
         return newptr;
     }
 }
 
+/*
+ * mm_heapstats - report free space by walking the index and the
+ *    list of blocks for each size in it
+ */
+void mm_heapstats(struct mm_heapstats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    small_stats(stats);
+    index_stats(stats);
+    stats->dup_entries = stats->free_blocks - stats->index_nodes;
+}
+
 team_t team = {
 
     .teamname = "twocringeguys",
@@ -5,6 +5,22 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 
+/*
+ * Free-space statistics used by the driver's telemetry mode (-T).
+ * An allocator need not provide mm_heapstats(); the driver checks
+ * whether the (weak) symbol is defined before calling it.
+ */
+struct mm_heapstats {
+    size_t free_bytes;      /* total size of all free blocks */
+    size_t free_blocks;     /* number of free blocks */
+    size_t largest_free;    /* size of the largest free block */
+    size_t index_nodes;     /* free blocks that are nodes of the free index */
+    size_t dup_entries;     /* free blocks kept on duplicate-size lists */
+    size_t index_bytes;     /* memory the free index uses outside the heap */
+};
+
+extern void mm_heapstats(struct mm_heapstats *stats) __attribute__((weak));
+
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
@@ -0,0 +1,754 @@
+/*
+ * mtbench.c - The classic multi-threaded allocator stress benchmarks
+ *
+ * Ports of the benchmarks that allocator papers and vendors quote,
+ * scaled to the simulated heap and run against the mm_* API:
+ *
+ *   larson       server-like churn: each thread replaces random blocks
+ *                in its own array, then hands the array to a freshly
+ *                created thread, so blocks are freed by threads other
+ *                than the ones that allocated them
+ *   threadtest   each thread allocates a batch of small objects and
+ *                frees them all, over and over
+ *   cache-scratch
+ *                passive false sharing: every thread starts by freeing
+ *                one of a set of adjacent objects allocated by the main
+ *                thread, then repeatedly allocates, writes and frees
+ *   cache-thrash active false sharing: threads repeatedly allocate,
+ *                write and free small objects; an allocator that hands
+ *                neighbouring objects to different threads runs slowly
+ *   xmalloc      producer threads allocate blocks and pass them through
+ *                a shared queue to consumer threads that free them
+ *
+ * Each benchmark reports its throughput in requests per second of wall
+ * clock time and, for mm malloc, its memory blowup: the heap size at
+ * the end divided by the most memory the benchmark can have live.  The
+ * latter is a bound derived from each benchmark's design, so the
+ * blowup reported is, if anything, on the low side.  cache-scratch and
+ * cache-thrash also report how many cache lines objects written by
+ * more than one thread fell on, which an allocator that keeps threads
+ * apart holds at zero.
+ *
+ * Link against a THREAD_SAFE build of the allocator (mtbench uses
+ * mmts.o); -l runs the same benchmarks against libc malloc.  With -o,
+ * the results are written in the layout of mdriver's results files,
+ * with util = 100 / blowup, so mdcompare can compare two builds.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "config.h"
+
+/* Benchmark parameters */
+#define DEFAULT_OPS      200000  /* requests per thread (-n) */
+#define DEFAULT_REPS          3  /* runs per benchmark; the median is kept */
+#define LARSON_CHUNKS      1000  /* blocks in each thread's array */
+#define LARSON_MIN            8  /* block sizes in larson */
+#define LARSON_MAX         1000
+#define LARSON_GENERATIONS   10  /* threads that inherit each array */
+#define TT_OBJS            1000  /* objects per threadtest batch */
+#define TT_SIZE               8  /* threadtest object size */
+#define CACHE_OBJ_SIZE        8  /* cache-scratch/-thrash object size */
+#define CACHE_WRITES        100  /* times each object's bytes are written */
+#define CACHE_LINE           64  /* for the shared-line count */
+#define CACHE_MAX_LINES    1024  /* distinct lines recorded per thread */
+#define XM_MIN               16  /* block sizes in xmalloc */
+#define XM_MAX              512
+#define XM_BATCH             64  /* blocks moved through the queue at once */
+#define XM_QBATCHES          64  /* batches the queue holds */
+
+/* The allocator under test */
+struct allocator {
+    const char *name;
+    int (*reset)(void);             /* start over with an empty heap */
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+};
+
+/* Per-thread state, one cache line apart so the harness itself does
+   not false-share */
+struct worker {
+    pthread_t tid;
+    int id;
+    unsigned seed;                  /* xorshift state */
+    double ops;                     /* requests made */
+    size_t required;                /* most bytes this thread held live */
+    void **slots;                   /* larson: the array being churned */
+    size_t *sizes;                  /* larson: size of each slot */
+    size_t live;                    /* larson: bytes held in the array */
+    int generation;                 /* larson: threads so far on this array */
+    void *obj;                      /* cache-scratch: object to free first */
+    uintptr_t *lines;               /* cache-*: lines this thread wrote */
+    int nlines;
+} __attribute__((aligned(64)));
+
+/* One benchmark: run() starts nthreads workers and joins them */
+struct bench {
+    const char *name;
+    void (*run)(struct worker *w, int nthreads);
+    double ops;                     /* requests in the median run */
+    double secs;                    /* its wall clock time */
+    double blowup;                  /* heap / required, 0 for libc */
+    double shared;                  /* lines written by several threads, or -1 */
+};
+
+static struct allocator *a;         /* selected at run time */
+static int nops = DEFAULT_OPS;      /* requests per thread */
+static int pin_threads = 0;         /* pin worker i to allowed CPU i (-p) */
+
+static void app_error(char *msg);
+
+/***********************************
+ * The allocators under test
+ ***********************************/
+
+static int mm_reset(void)
+{
+    mem_reset_brk();
+    return mm_init();
+}
+
+static int libc_reset(void)
+{
+    return 0;
+}
+
+static struct allocator mm_allocator = { "mm", mm_reset, mm_malloc, mm_free };
+static struct allocator libc_allocator = { "libc", libc_reset, malloc, free };
+
+/* allocate a block and write to it, as a program would */
+static inline void *alloc(size_t size)
+{
+    char *p = a->malloc(size);
+    if (p == NULL)
+        app_error("mtbench: malloc failed");
+    *p = (char)size;
+    return p;
+}
+
+static inline unsigned xorshift(unsigned *state)
+{
+    unsigned x = *state;
+    x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+    return *state = x;
+}
+
+static inline size_t rand_between(unsigned *state, size_t lo, size_t hi)
+{
+    return lo + xorshift(state) % (hi - lo + 1);
+}
+
+/*
+ * pin_thread - with -p, restrict the calling thread to the k-th CPU it
+ *     is allowed to run on (modulo their number)
+ */
+static void pin_thread(int k)
+{
+    cpu_set_t allowed, mine;
+    int cpu, n = 0;
+
+    if (!pin_threads || sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
+    k %= CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || n++ != k)
+            continue;
+        CPU_ZERO(&mine);
+        CPU_SET(cpu, &mine);
+        pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine);
+        return;
+    }
+}
+
+/* start one thread per worker running fn and wait for all of them */
+static void run_workers(struct worker *w, int nthreads, void *(*fn)(void *))
+{
+    int i;
+
+    for (i = 0; i < nthreads; i++)
+        if (pthread_create(&w[i].tid, NULL, fn, &w[i]) != 0)
+            app_error("mtbench: pthread_create failed");
+    for (i = 0; i < nthreads; i++)
+        pthread_join(w[i].tid, NULL);
+}
+
+/***********************************
+ * larson
+ ***********************************/
+
+static void *larson_worker(void *arg)
+{
+    struct worker *w = arg;
+    int i, rounds = nops / (2 * LARSON_GENERATIONS);
+    pthread_t next;
+
+    pin_thread(w->id);
+    for (i = 0; i < rounds; i++) {
+        int slot = xorshift(&w->seed) % LARSON_CHUNKS;
+        size_t size = rand_between(&w->seed, LARSON_MIN, LARSON_MAX);
+
+        a->free(w->slots[slot]);
+        w->live += size - w->sizes[slot];
+        w->slots[slot] = alloc(size);
+        w->sizes[slot] = size;
+        if (w->live > w->required)
+            w->required = w->live;
+    }
+    w->ops += 2.0 * rounds;
+
+    /* like the original, pass the array on to a new thread */
+    if (++w->generation < LARSON_GENERATIONS) {
+        if (pthread_create(&next, NULL, larson_worker, w) != 0)
+            app_error("mtbench: pthread_create failed");
+        pthread_join(next, NULL);
+    }
+    return NULL;
+}
+
+static void bench_larson(struct worker *w, int nthreads)
+{
+    int i, j;
+
+    /* the main thread fills every array, so the first generation
+       already frees blocks it did not allocate */
+    for (i = 0; i < nthreads; i++) {
+        w[i].slots = malloc(LARSON_CHUNKS * sizeof(void *));
+        w[i].sizes = malloc(LARSON_CHUNKS * sizeof(size_t));
+        if (w[i].slots == NULL || w[i].sizes == NULL)
+            app_error("mtbench: out of memory");
+        for (j = 0; j < LARSON_CHUNKS; j++) {
+            w[i].sizes[j] = rand_between(&w[i].seed, LARSON_MIN, LARSON_MAX);
+            w[i].slots[j] = alloc(w[i].sizes[j]);
+            w[i].live += w[i].sizes[j];
+        }
+        w[i].required = w[i].live;
+        w[i].ops = LARSON_CHUNKS;
+    }
+    run_workers(w, nthreads, larson_worker);
+    for (i = 0; i < nthreads; i++) {
+        for (j = 0; j < LARSON_CHUNKS; j++)
+            a->free(w[i].slots[j]);
+        w[i].ops += LARSON_CHUNKS;
+        free(w[i].slots);
+        free(w[i].sizes);
+    }
+}
+
+/***********************************
+ * threadtest
+ ***********************************/
+
+static void *threadtest_worker(void *arg)
+{
+    struct worker *w = arg;
+    void *objs[TT_OBJS];
+    int i, iter, iters = nops / (2 * TT_OBJS);
+
+    pin_thread(w->id);
+    for (iter = 0; iter < iters; iter++) {
+        for (i = 0; i < TT_OBJS; i++)
+            objs[i] = alloc(TT_SIZE);
+        for (i = 0; i < TT_OBJS; i++)
+            a->free(objs[i]);
+    }
+    w->ops = 2.0 * TT_OBJS * iters;
+    w->required = TT_OBJS * TT_SIZE;
+    return NULL;
+}
+
+static void bench_threadtest(struct worker *w, int nthreads)
+{
+    run_workers(w, nthreads, threadtest_worker);
+}
+
+/***********************************
+ * cache-scratch and cache-thrash
+ ***********************************/
+
+/* The workers start together and stay until all are done, so they all
+   run at once and none hands its memory on to another mid-run */
+static pthread_barrier_t cache_barrier;
+
+/* note the lines from p to p + size, unless they are the last ones noted */
+static void note_lines(struct worker *w, volatile char *p, size_t size)
+{
+    uintptr_t line = (uintptr_t)p / CACHE_LINE;
+    uintptr_t last = ((uintptr_t)p + size - 1) / CACHE_LINE;
+
+    for (; line <= last; line++)
+        if ((w->nlines == 0 || w->lines[w->nlines - 1] != line) &&
+            w->nlines < CACHE_MAX_LINES)
+            w->lines[w->nlines++] = line;
+}
+
+/* allocate, write and free nops/2 objects */
+static void cache_loop(struct worker *w)
+{
+    int i, j, k, iters = nops / 2;
+
+    pthread_barrier_wait(&cache_barrier);
+    for (i = 0; i < iters; i++) {
+        volatile char *p = alloc(CACHE_OBJ_SIZE);
+        note_lines(w, p, CACHE_OBJ_SIZE);
+        for (j = 0; j < CACHE_WRITES; j++)
+            for (k = 0; k < CACHE_OBJ_SIZE; k++)
+                p[k]++;
+        a->free((void *)p);
+    }
+    w->ops += 2.0 * iters;
+    w->required = CACHE_OBJ_SIZE;
+    pthread_barrier_wait(&cache_barrier);
+}
+
+static void *cache_scratch_worker(void *arg)
+{
+    struct worker *w = arg;
+
+    pin_thread(w->id);
+    a->free(w->obj);
+    w->ops = 1;
+    cache_loop(w);
+    return NULL;
+}
+
+static void *cache_thrash_worker(void *arg)
+{
+    struct worker *w = arg;
+
+    pin_thread(w->id);
+    cache_loop(w);
+    return NULL;
+}
+
+static void bench_cache_scratch(struct worker *w, int nthreads)
+{
+    int i;
+
+    /* allocated back to back, so neighbours likely share a line */
+    for (i = 0; i < nthreads; i++)
+        w[i].obj = alloc(CACHE_OBJ_SIZE);
+    pthread_barrier_init(&cache_barrier, NULL, nthreads);
+    run_workers(w, nthreads, cache_scratch_worker);
+    pthread_barrier_destroy(&cache_barrier);
+    w[0].ops += nthreads;
+}
+
+static void bench_cache_thrash(struct worker *w, int nthreads)
+{
+    pthread_barrier_init(&cache_barrier, NULL, nthreads);
+    run_workers(w, nthreads, cache_thrash_worker);
+    pthread_barrier_destroy(&cache_barrier);
+}
+
+static int cmp_line(const void *x, const void *y)
+{
+    const uintptr_t *l = x, *m = y;
+
+    return l[0] != m[0] ? (l[0] < m[0] ? -1 : 1) : (l[1] > m[1]) - (l[1] < m[1]);
+}
+
+/*
+ * shared_lines - the number of cache lines that objects written by more
+ *     than one worker fell on, or -1 if the workers recorded none
+ */
+static double shared_lines(struct worker *w, int nthreads)
+{
+    uintptr_t (*all)[2];
+    int i, j, n = 0, shared = 0;
+
+    for (i = 0; i < nthreads; i++)
+        n += w[i].nlines;
+    if (n == 0)
+        return -1;
+    if ((all = malloc(n * sizeof(*all))) == NULL)
+        app_error("mtbench: out of memory");
+    for (i = n = 0; i < nthreads; i++)
+        for (j = 0; j < w[i].nlines; j++) {
+            all[n][0] = w[i].lines[j];
+            all[n++][1] = i;
+        }
+    qsort(all, n, sizeof(*all), cmp_line);
+    for (i = 0; i < n; i = j) {
+        int threads = 1;
+        for (j = i + 1; j < n && all[j][0] == all[i][0]; j++)
+            threads += all[j][1] != all[j - 1][1];
+        shared += threads > 1;
+    }
+    free(all);
+    return shared;
+}
+
+/***********************************
+ * xmalloc
+ ***********************************/
+
+#define XM_QSIZE (XM_BATCH * XM_QBATCHES)
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty, nonfull;
+    void *ptr[XM_QSIZE];
+    size_t size[XM_QSIZE];
+    int head, count;
+    int producing;                  /* producers not yet finished */
+    size_t bytes, peak;             /* bytes in the queue */
+} xq = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+         PTHREAD_COND_INITIALIZER };
+
+static void *xmalloc_producer(void *arg)
+{
+    struct worker *w = arg;
+    void *ptr[XM_BATCH];
+    size_t size[XM_BATCH];
+    int i, b, batches = nops / XM_BATCH;
+
+    pin_thread(w->id);
+    for (b = 0; b < batches; b++) {
+        size_t bytes = 0;
+        for (i = 0; i < XM_BATCH; i++) {
+            size[i] = rand_between(&w->seed, XM_MIN, XM_MAX);
+            ptr[i] = alloc(size[i]);
+            bytes += size[i];
+        }
+        pthread_mutex_lock(&xq.lock);
+        while (xq.count + XM_BATCH > XM_QSIZE)
+            pthread_cond_wait(&xq.nonfull, &xq.lock);
+        for (i = 0; i < XM_BATCH; i++) {
+            int tail = (xq.head + xq.count++) % XM_QSIZE;
+            xq.ptr[tail] = ptr[i];
+            xq.size[tail] = size[i];
+        }
+        if (bytes > w->required)
+            w->required = bytes;
+        xq.bytes += bytes;
+        if (xq.bytes > xq.peak)
+            xq.peak = xq.bytes;
+        pthread_cond_signal(&xq.nonempty);
+        pthread_mutex_unlock(&xq.lock);
+    }
+    pthread_mutex_lock(&xq.lock);
+    if (--xq.producing == 0)
+        pthread_cond_broadcast(&xq.nonempty);
+    pthread_mutex_unlock(&xq.lock);
+    w->ops = (double)XM_BATCH * batches;
+    return NULL;
+}
+
+static void *xmalloc_consumer(void *arg)
+{
+    struct worker *w = arg;
+    void *ptr[XM_BATCH];
+    size_t bytes;
+    int i, n;
+
+    pin_thread(w->id);
+    for (;;) {
+        pthread_mutex_lock(&xq.lock);
+        while (xq.count == 0 && xq.producing > 0)
+            pthread_cond_wait(&xq.nonempty, &xq.lock);
+        if (xq.count == 0) {
+            pthread_mutex_unlock(&xq.lock);
+            break;
+        }
+        for (bytes = 0, n = 0; n < XM_BATCH && xq.count > 0; n++, xq.count--) {
+            ptr[n] = xq.ptr[xq.head];
+            bytes += xq.size[xq.head];
+            xq.bytes -= xq.size[xq.head];
+            xq.head = (xq.head + 1) % XM_QSIZE;
+        }
+        pthread_cond_signal(&xq.nonfull);
+        pthread_mutex_unlock(&xq.lock);
+        if (bytes > w->required)
+            w->required = bytes;
+
+        for (i = 0; i < n; i++)
+            a->free(ptr[i]);
+        w->ops += n;
+    }
+    return NULL;
+}
+
+static void *xmalloc_worker(void *arg)
+{
+    struct worker *w = arg;
+    return w->id % 2 ? xmalloc_consumer(w) : xmalloc_producer(w);
+}
+
+static void bench_xmalloc(struct worker *w, int nthreads)
+{
+    int n = nthreads < 2 ? 2 : nthreads;   /* need one of each */
+
+    xq.head = xq.count = 0;
+    xq.bytes = xq.peak = 0;
+    xq.producing = (n + 1) / 2;
+    run_workers(w, n, xmalloc_worker);
+    w[0].required += xq.peak;
+}
+
+static struct bench benches[] = {
+    { "larson",        bench_larson },
+    { "threadtest",    bench_threadtest },
+    { "cache-scratch", bench_cache_scratch },
+    { "cache-thrash",  bench_cache_thrash },
+    { "xmalloc",       bench_xmalloc },
+};
+#define NBENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+/***********************************
+ * The harness
+ ***********************************/
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1E-9 * ts.tv_nsec;
+}
+
+/*
+ * run_bench - run a benchmark reps times from an empty heap and keep
+ *     the run with the median throughput
+ */
+static void run_bench(struct bench *b, int nthreads, int reps)
+{
+    /* xmalloc runs at least two threads */
+    int nworkers = nthreads < 2 ? 2 : nthreads;
+    struct worker *w;
+    double tput[reps], ops[reps], secs[reps], blowup[reps], shared[reps];
+    uintptr_t *lines;
+    int r, i;
+
+    if ((w = aligned_alloc(64, nworkers * sizeof(*w))) == NULL ||
+        (lines = malloc(nworkers * CACHE_MAX_LINES * sizeof(*lines))) == NULL)
+        app_error("mtbench: out of memory");
+    for (r = 0; r < reps; r++) {
+        size_t required = 0;
+        double start, total = 0;
+
+        memset(w, 0, nworkers * sizeof(*w));
+        for (i = 0; i < nworkers; i++) {
+            w[i].id = i;
+            w[i].seed = 2463534242u + 7919 * i;
+            w[i].lines = lines + i * CACHE_MAX_LINES;
+        }
+        if (a->reset() < 0)
+            app_error("mtbench: mm_init failed");
+
+        start = now_secs();
+        b->run(w, nthreads);
+        secs[r] = now_secs() - start;
+
+        for (i = 0; i < nworkers; i++) {
+            total += w[i].ops;
+            required += w[i].required;
+        }
+        ops[r] = total;
+        tput[r] = total / secs[r];
+        blowup[r] = a == &mm_allocator && required > 0 ?
+            (double)mem_heapsize() / required : 0;
+        shared[r] = shared_lines(w, nworkers);
+    }
+
+    /* pick the median run by throughput */
+    for (r = 0; r < reps; r++) {
+        int below = 0, same = 0;
+        for (i = 0; i < reps; i++) {
+            below += tput[i] < tput[r];
+            same += tput[i] == tput[r];
+        }
+        if (below <= reps / 2 && below + same > reps / 2)
+            break;
+    }
+    b->ops = ops[r];
+    b->secs = secs[r];
+    b->blowup = blowup[r];
+    b->shared = shared[r];
+    free(lines);
+    free(w);
+}
+
+/*
+ * printresults - print one line per benchmark that was run
+ */
+static void printresults(int nthreads)
+{
+    int i;
+
+    printf("%-14s %8s %11s %9s %11s %8s %7s\n", "bench", "threads", "ops",
+           "secs", "Mops/s", "blowup", "shared");
+    for (i = 0; i < NBENCHES; i++) {
+        struct bench *b = &benches[i];
+        char blowup[16] = "-", shared[16] = "-";
+
+        if (b->ops == 0)
+            continue;
+        if (b->blowup > 0)
+            snprintf(blowup, sizeof blowup, "%.2f", b->blowup);
+        if (b->shared >= 0)
+            snprintf(shared, sizeof shared, "%.0f", b->shared);
+        printf("%-14s %8d %11.0f %9.4f %11.3f %8s %7s\n", b->name, nthreads,
+               b->ops, b->secs, b->ops / b->secs / 1e6, blowup, shared);
+    }
+}
+
+/*
+ * printresults_as_json - write the results in the layout of mdriver's
+ *     results files; the benchmarks play the part of the traces
+ */
+static void printresults_as_json(FILE *json, int nthreads)
+{
+    int i, first = 1;
+
+    fprintf(json, "{ \"version\": \"1.1\",\n \"allocator\": \"%s\",\n"
+            " \"nthreads\": %d,\n \"results\": [\n", a->name, nthreads);
+    for (i = 0; i < NBENCHES; i++) {
+        struct bench *b = &benches[i];
+
+        if (b->ops == 0)
+            continue;
+        fprintf(json, "%s{ \"trace\": \"%s\", \"valid\": true, \"ops\": %f, "
+                "\"secs\": %f, \"Kops\": %f", first ? "" : ", ",
+                b->name, b->ops, b->secs, (b->ops / 1e3) / b->secs);
+        if (b->blowup > 0)
+            fprintf(json, ", \"blowup\": %f, \"util\": %f",
+                    b->blowup, 100.0 / b->blowup);
+        if (b->shared >= 0)
+            fprintf(json, ", \"shared_lines\": %.0f", b->shared);
+        fprintf(json, " }\n");
+        first = 0;
+    }
+    fprintf(json, "]}\n");
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mtbench [-hlpv] [-t <threads>] [-n <ops>] [-r <reps>]\n"
+                    "               [-b <bench>] [-o <file>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b <bench>   Run only this benchmark (may be repeated).\n");
+    fprintf(stderr, "\t-h           Print this message.\n");
+    fprintf(stderr, "\t-l           Run libc malloc instead of the linked allocator.\n");
+    fprintf(stderr, "\t-n <ops>     Requests per thread (default %d).\n", DEFAULT_OPS);
+    fprintf(stderr, "\t-o <file>    Also write the results as JSON to <file>.\n");
+    fprintf(stderr, "\t-p           Pin each thread to its own CPU.\n");
+    fprintf(stderr, "\t-r <reps>    Runs per benchmark; the median is reported (default %d).\n",
+            DEFAULT_REPS);
+    fprintf(stderr, "\t-t <threads> Worker threads (default: online CPUs).\n");
+    fprintf(stderr, "\t-v           Print the benchmarks as they run.\n");
+    fprintf(stderr, "Benchmarks:");
+    for (int i = 0; i < NBENCHES; i++)
+        fprintf(stderr, " %s", benches[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    int selected[NBENCHES] = { 0 };
+    int nselected = 0, verbose = 0, reps = DEFAULT_REPS;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *jsonfile = NULL;
+    int c, i;
+
+    a = &mm_allocator;
+    while ((c = getopt(argc, argv, "b:hln:o:pr:t:v")) != EOF) {
+        switch (c) {
+        case 'b':
+            for (i = 0; i < NBENCHES; i++)
+                if (strcmp(optarg, benches[i].name) == 0)
+                    break;
+            if (i == NBENCHES) {
+                fprintf(stderr, "mtbench: unknown benchmark %s\n", optarg);
+                usage();
+                exit(1);
+            }
+            selected[i] = 1;
+            nselected++;
+            break;
+        case 'l':
+            a = &libc_allocator;
+            break;
+        case 'n':
+            nops = atoi(optarg);
+            if (nops < 2 * TT_OBJS) {
+                fprintf(stderr, "mtbench: -n must be at least %d\n", 2 * TT_OBJS);
+                exit(1);
+            }
+            break;
+        case 'o':
+            jsonfile = optarg;
+            break;
+        case 'p':
+            pin_threads = 1;
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            if (reps < 1) {
+                fprintf(stderr, "mtbench: -r must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads < 1) {
+                fprintf(stderr, "mtbench: -t must be at least 1\n");
+                exit(1);
+            }
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    mem_init(0);
+    for (i = 0; i < NBENCHES; i++) {
+        if (nselected > 0 && !selected[i])
+            continue;
+        if (verbose) {
+            printf("Running %s with %d threads on %s malloc\n",
+                   benches[i].name, nthreads, a->name);
+            fflush(stdout);
+        }
+        run_bench(&benches[i], nthreads, reps);
+    }
+
+    printf("\nResults for %s malloc:\n", a->name);
+    printresults(nthreads);
+
+    if (jsonfile) {
+        FILE *json = fopen(jsonfile, "w");
+        if (json == NULL) {
+            perror(jsonfile);
+            exit(1);
+        }
+        printresults_as_json(json, nthreads);
+        fclose(json);
+    }
+
+    mem_deinit();
+    exit(0);
+}
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+static void app_error(char *msg)
+{
+    printf("%s\n", msg);
+    exit(1);
+}
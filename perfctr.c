@@ -0,0 +1,137 @@
+/*
+ * perfctr.c - Hardware performance counters around a measured run
+ *
+ * See perfctr.h.  Counters measure the calling thread in user mode
+ * only, which works with the default perf_event_paranoid setting.
+ * Counters are per-process; perf_start() reopens them when it notices
+ * it is running in a forked child, such as an mdriver -j worker.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perfctr.h"
+
+const char *perf_event_names[PERF_NEVENTS] = {
+    "cycles", "instructions", "L1d-misses", "LLC-misses",
+    "dTLB-misses", "branch-misses"
+};
+
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+static const struct { uint32_t type; uint64_t config; } events[PERF_NEVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+                                      PERF_COUNT_HW_CACHE_OP_READ,
+                                      PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB,
+                                      PERF_COUNT_HW_CACHE_OP_READ,
+                                      PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int fds[PERF_NEVENTS] = { -1, -1, -1, -1, -1, -1 };
+static pid_t opened_pid = 0;
+
+/*
+ * perf_open - Open every counter we know about for the calling process.
+ *     Counters that the kernel or hardware refuses are skipped.  With
+ *     verbose set, say which ones are missing.
+ */
+int perf_open(int verbose)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    if (opened_pid == getpid()) {
+        for (i = 0; i < PERF_NEVENTS; i++)
+            n += fds[i] >= 0;
+        return n;
+    }
+    perf_close();
+
+    for (i = 0; i < PERF_NEVENTS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[i] >= 0)
+            n++;
+        else if (verbose)
+            fprintf(stderr, "perfctr: %s unavailable: %s\n",
+                    perf_event_names[i], strerror(errno));
+    }
+    opened_pid = getpid();
+    return n;
+}
+
+/*
+ * perf_start - reset and enable the open counters
+ */
+void perf_start(void)
+{
+    int i;
+
+    if (opened_pid != getpid())
+        perf_open(0);
+    for (i = 0; i < PERF_NEVENTS; i++) {
+        if (fds[i] < 0)
+            continue;
+        ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/*
+ * perf_stop - disable the counters and read them, scaling each value
+ *     by enabled/running time in case the kernel multiplexed it.
+ */
+void perf_stop(struct perf_counts *c)
+{
+    uint64_t buf[3];   /* value, time enabled, time running */
+    int i;
+
+    for (i = 0; i < PERF_NEVENTS; i++)
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    c->valid = 0;
+    for (i = 0; i < PERF_NEVENTS; i++) {
+        c->value[i] = 0;
+        if (fds[i] < 0 || read(fds[i], buf, sizeof(buf)) != sizeof(buf))
+            continue;
+        if (buf[2] == 0)        /* never got scheduled on the PMU */
+            continue;
+        c->value[i] = (double)buf[0];
+        if (buf[2] < buf[1])
+            c->value[i] *= (double)buf[1] / (double)buf[2];
+        c->valid |= 1u << i;
+    }
+}
+
+/*
+ * perf_close - close all open counters
+ */
+void perf_close(void)
+{
+    int i;
+
+    for (i = 0; i < PERF_NEVENTS; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+    opened_pid = 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * perfctr.h - Hardware performance counters around a measured run
+ *
+ * Thin wrapper over Linux perf_event_open.  Each event is opened on
+ * its own, so a machine (or container) that lacks some of them still
+ * reports the rest; events that could not be opened read as invalid.
+ */
+#ifndef __PERFCTR_H_
+#define __PERFCTR_H_
+
+#include <stdint.h>
+
+enum perf_event_id {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_NEVENTS
+};
+
+/* Counter values from one measured run */
+struct perf_counts {
+    unsigned valid;                 /* bit i set if event i was counted */
+    double value[PERF_NEVENTS];     /* scaled for multiplexing */
+};
+
+/* Short names used in tables and JSON, indexed by enum perf_event_id */
+extern const char *perf_event_names[PERF_NEVENTS];
+
+/* Open the counters for the calling process; returns how many opened */
+int perf_open(int verbose);
+
+/* Zero and enable all open counters */
+void perf_start(void);
+
+/* Disable the counters and read them into *c */
+void perf_stop(struct perf_counts *c);
+
+/* Close the counters */
+void perf_close(void);
+
+#endif /* __PERFCTR_H_ */
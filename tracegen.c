@@ -0,0 +1,514 @@
+/*
+ * tracegen.c - Synthetic trace generator for the malloc lab driver
+ *
+ * Reads a declarative workload spec and writes a trace file in the
+ * format read by mdriver's read_trace().  The spec describes one or
+ * more phases, each with its own size distribution, lifetime
+ * distribution, live-set target and realloc behavior.  Output is a
+ * pure function of the spec and the seed, so a corpus of traces can
+ * be regenerated bit for bit.
+ *
+ * Spec syntax (one "key = value" per line, '#' starts a comment):
+ *
+ *   seed     = 42                  RNG seed (global)
+ *   ops      = 1000000             ops to generate in this phase
+ *   live     = 4194304             live-set target in bytes
+ *   size     = <mix>               request size distribution (bytes)
+ *   lifetime = <mix>               block lifetime distribution (ops)
+ *   realloc  = 0.05                probability that an op is a realloc
+ *   grow     = 1.5                 realloc size factor (0: redraw size)
+ *   phase                          start a new phase; all settings
+ *                                  but ops carry over (ops resets
+ *                                  to 100000)
+ *
+ * A <mix> is a comma-separated list of components, each optionally
+ * preceded by a weight:
+ *
+ *   fixed V | uniform LO HI | exp MEAN | lognormal MEDIAN SIGMA |
+ *   pareto XM ALPHA [CAP]
+ *
+ * e.g. "size = 0.9 lognormal 48 0.7, 0.1 pareto 4096 1.2 1048576".
+ *
+ * Each op frees the block whose lifetime expired first if it is due
+ * (or if the live set exceeds its target), otherwise it reallocs a
+ * random live block with probability "realloc", otherwise it
+ * allocates a new block.  All blocks still live at the end of the
+ * last phase are freed, so generated traces are balanced.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#define MAXLINE     1024  /* max spec line length */
+#define MAXPHASES     64  /* max phases in one spec */
+#define MAXCOMP        8  /* max components in one distribution mix */
+#define MAXSIZE  (1<<24)  /* largest request size we ever emit */
+#define HDRWIDTH      12  /* width of each (rewritten) header field */
+#define DEFAULT_OPS 100000  /* ops in a phase that does not set them */
+
+/* One component of a distribution mix */
+struct dist_comp {
+    enum { D_FIXED, D_UNIFORM, D_EXP, D_LOGNORMAL, D_PARETO } kind;
+    double weight;        /* cumulative weight, normalized to 1.0 */
+    double a, b, cap;     /* kind-specific parameters */
+};
+
+struct dist {
+    int ncomp;
+    struct dist_comp comp[MAXCOMP];
+};
+
+/* Settings for one phase of the workload */
+struct phase {
+    long long ops;        /* ops in this phase */
+    long long live;       /* live-set target in bytes */
+    double realloc_p;     /* probability of a realloc op */
+    double grow;          /* realloc growth factor, 0 to redraw */
+    struct dist size;     /* request sizes, in bytes */
+    struct dist lifetime; /* lifetimes, in ops */
+};
+
+/* A live block, kept in a min-heap ordered by time of death */
+struct live_block {
+    uint64_t death;
+    unsigned id;
+    unsigned size;
+};
+
+static struct phase phases[MAXPHASES];
+static int nphases;
+static uint64_t seed = 1;
+
+static struct live_block *heap;
+static size_t heap_len, heap_cap;
+
+/*****************************
+ * Random number generation
+ ****************************/
+
+static uint64_t rng_state;
+
+/* splitmix64 - fast, well-mixed and fully deterministic */
+static uint64_t rng_next(void)
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform double in [0, 1) */
+static double rng_double(void)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Standard normal deviate (Box-Muller, one value per call) */
+static double rng_normal(void)
+{
+    double u1 = rng_double(), u2 = rng_double();
+    if (u1 < 1e-300)
+        u1 = 1e-300;
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+/* Draw one value from a distribution mix */
+static double dist_sample(const struct dist *d)
+{
+    const struct dist_comp *c = &d->comp[0];
+    double v, u;
+
+    if (d->ncomp > 1) {
+        u = rng_double();
+        for (int i = 0; i < d->ncomp - 1 && u >= d->comp[i].weight; i++)
+            c = &d->comp[i + 1];
+    }
+
+    switch (c->kind) {
+    case D_FIXED:
+        v = c->a;
+        break;
+    case D_UNIFORM:
+        v = c->a + rng_double() * (c->b - c->a + 1);
+        break;
+    case D_EXP:
+        v = -c->a * log(1.0 - rng_double());
+        break;
+    case D_LOGNORMAL:
+        v = c->a * exp(c->b * rng_normal());
+        break;
+    case D_PARETO:
+        v = c->a / pow(1.0 - rng_double(), 1.0 / c->b);
+        break;
+    default:
+        abort();
+    }
+    if (c->cap > 0 && v > c->cap)
+        v = c->cap;
+    return v;
+}
+
+/*****************************
+ * Spec parsing
+ ****************************/
+
+static void spec_error(const char *file, int lineno, const char *msg)
+{
+    fprintf(stderr, "%s:%d: %s\n", file, lineno, msg);
+    exit(1);
+}
+
+/*
+ * parse_dist - Parse a distribution mix such as
+ *     "0.9 lognormal 48 0.7, 0.1 pareto 4096 1.2 1048576"
+ */
+static int parse_dist(char *s, struct dist *d)
+{
+    double total = 0;
+    char *comp, *save;
+
+    d->ncomp = 0;
+    for (comp = strtok_r(s, ",", &save); comp; comp = strtok_r(NULL, ",", &save)) {
+        struct dist_comp *c;
+        char name[32];
+        double p[3] = { 0, 0, 0 };
+        double w = 1.0;
+        int n;
+
+        if (d->ncomp == MAXCOMP)
+            return -1;
+        c = &d->comp[d->ncomp++];
+
+        while (isspace((unsigned char)*comp))
+            comp++;
+        if (isdigit((unsigned char)*comp) || *comp == '.') {
+            w = strtod(comp, &comp);
+            if (w <= 0)
+                return -1;
+        }
+        if (sscanf(comp, "%31s%n", name, &n) != 1)
+            return -1;
+        int nparams = sscanf(comp + n, "%lf %lf %lf", &p[0], &p[1], &p[2]);
+
+        c->cap = 0;
+        if (!strcmp(name, "fixed") && nparams == 1) {
+            c->kind = D_FIXED;
+        } else if (!strcmp(name, "uniform") && nparams == 2 && p[1] >= p[0]) {
+            c->kind = D_UNIFORM;
+        } else if (!strcmp(name, "exp") && nparams == 1) {
+            c->kind = D_EXP;
+        } else if (!strcmp(name, "lognormal") && nparams == 2) {
+            c->kind = D_LOGNORMAL;
+        } else if (!strcmp(name, "pareto") && nparams >= 2 && p[1] > 0) {
+            c->kind = D_PARETO;
+            if (nparams == 3)
+                c->cap = p[2];
+        } else
+            return -1;
+        c->a = p[0];
+        c->b = p[1];
+        total += w;
+        c->weight = total;   /* cumulative; normalized below */
+    }
+    if (d->ncomp == 0)
+        return -1;
+    for (int i = 0; i < d->ncomp; i++)
+        d->comp[i].weight /= total;
+    return 0;
+}
+
+/*
+ * read_spec - Read the workload spec in file into phases[]
+ */
+static void read_spec(const char *file)
+{
+    char line[MAXLINE];
+    int lineno = 0;
+    FILE *fp = strcmp(file, "-") ? fopen(file, "r") : stdin;
+
+    if (fp == NULL) {
+        perror(file);
+        exit(1);
+    }
+
+    /* defaults for the first phase */
+    nphases = 1;
+    memset(&phases[0], 0, sizeof(phases[0]));
+    phases[0].ops = DEFAULT_OPS;
+    phases[0].live = 1 << 20;
+    phases[0].size.ncomp = 1;
+    phases[0].size.comp[0] = (struct dist_comp) { D_UNIFORM, 1.0, 16, 512, 0 };
+    phases[0].lifetime.ncomp = 1;
+    phases[0].lifetime.comp[0] = (struct dist_comp) { D_EXP, 1.0, 1000, 0, 0 };
+
+    while (fgets(line, sizeof line, fp) != NULL) {
+        struct phase *ph = &phases[nphases - 1];
+        char *key, *val, *p;
+
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+        for (key = line; isspace((unsigned char)*key); key++)
+            ;
+        p = key + strlen(key);
+        while (p > key && isspace((unsigned char)p[-1]))
+            *--p = '\0';
+        if (*key == '\0')
+            continue;
+
+        if (!strcmp(key, "phase")) {
+            if (nphases == MAXPHASES)
+                spec_error(file, lineno, "too many phases");
+            phases[nphases] = *ph;
+            phases[nphases].ops = DEFAULT_OPS;
+            nphases++;
+            continue;
+        }
+
+        if ((val = strchr(key, '=')) == NULL)
+            spec_error(file, lineno, "expected key = value");
+        *val++ = '\0';
+        p = val - 1;
+        while (p > key && isspace((unsigned char)p[-1]))
+            *--p = '\0';
+        while (isspace((unsigned char)*val))
+            val++;
+
+        if (!strcmp(key, "seed"))
+            seed = strtoull(val, NULL, 0);
+        else if (!strcmp(key, "ops"))
+            ph->ops = strtoll(val, NULL, 0);
+        else if (!strcmp(key, "live"))
+            ph->live = strtoll(val, NULL, 0);
+        else if (!strcmp(key, "realloc"))
+            ph->realloc_p = atof(val);
+        else if (!strcmp(key, "grow"))
+            ph->grow = atof(val);
+        else if (!strcmp(key, "size")) {
+            if (parse_dist(val, &ph->size) < 0)
+                spec_error(file, lineno, "bad size distribution");
+        } else if (!strcmp(key, "lifetime")) {
+            if (parse_dist(val, &ph->lifetime) < 0)
+                spec_error(file, lineno, "bad lifetime distribution");
+        } else
+            spec_error(file, lineno, "unknown key");
+    }
+    if (fp != stdin)
+        fclose(fp);
+}
+
+/*****************************
+ * Live-block min-heap
+ ****************************/
+
+static void heap_push(struct live_block b)
+{
+    size_t i;
+
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? 2 * heap_cap : 4096;
+        if ((heap = realloc(heap, heap_cap * sizeof(*heap))) == NULL) {
+            fprintf(stderr, "tracegen: out of memory\n");
+            exit(1);
+        }
+    }
+    for (i = heap_len++; i > 0 && heap[(i - 1) / 2].death > b.death; i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i] = b;
+}
+
+static struct live_block heap_pop(void)
+{
+    struct live_block top = heap[0];
+    struct live_block last = heap[--heap_len];
+    size_t i = 0, child;
+
+    while ((child = 2 * i + 1) < heap_len) {
+        if (child + 1 < heap_len && heap[child + 1].death < heap[child].death)
+            child++;
+        if (last.death <= heap[child].death)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/*****************************
+ * Trace output
+ ****************************/
+
+static FILE *out;
+static char obuf[1 << 16];
+static size_t olen;
+
+static void out_flush(void)
+{
+    if (fwrite(obuf, 1, olen, out) != olen) {
+        perror("tracegen: write");
+        exit(1);
+    }
+    olen = 0;
+}
+
+/* Append an unsigned decimal number, preceded by a blank */
+static void out_num(unsigned v)
+{
+    char tmp[12];
+    int n = 0;
+
+    do
+        tmp[n++] = '0' + v % 10;
+    while ((v /= 10) != 0);
+    obuf[olen++] = ' ';
+    while (n > 0)
+        obuf[olen++] = tmp[--n];
+}
+
+/* Emit one trace op; size is ignored for frees */
+static void emit(char type, unsigned id, unsigned size)
+{
+    if (olen > sizeof(obuf) - 32)
+        out_flush();
+    obuf[olen++] = type;
+    out_num(id);
+    if (type != 'f')
+        out_num(size);
+    obuf[olen++] = '\n';
+}
+
+static unsigned draw_size(const struct phase *ph)
+{
+    double v = dist_sample(&ph->size);
+    if (v < 1)
+        return 1;
+    return v > MAXSIZE ? MAXSIZE : (unsigned)v;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracegen [-s <seed>] [-n <ops>] -o <file> <spec>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-o <file>  Write the trace to <file>.\n");
+    fprintf(stderr, "\t-s <seed>  Override the seed given in the spec.\n");
+    fprintf(stderr, "\t-n <ops>   Override the op count of every phase.\n");
+    fprintf(stderr, "\t<spec>     Workload spec file, or - for stdin.\n");
+}
+
+int main(int argc, char **argv)
+{
+    char *outfile = NULL;
+    long long ops_override = 0;
+    int have_seed = 0;
+    uint64_t seed_override = 0;
+    char c;
+
+    while ((c = getopt(argc, argv, "o:s:n:h")) != EOF) {
+        switch (c) {
+        case 'o':
+            outfile = optarg;
+            break;
+        case 's':
+            have_seed = 1;
+            seed_override = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            ops_override = strtoll(optarg, NULL, 0);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (outfile == NULL || optind != argc - 1) {
+        usage();
+        exit(1);
+    }
+
+    read_spec(argv[optind]);
+    if (have_seed)
+        seed = seed_override;
+    rng_state = seed;
+
+    if ((out = fopen(outfile, "w")) == NULL) {
+        perror(outfile);
+        exit(1);
+    }
+
+    /* Header placeholder, rewritten once the counts are known */
+    fprintf(out, "%*d\n%*d\n%*d\n%*d\n", HDRWIDTH, 0, HDRWIDTH, 0, HDRWIDTH, 0, HDRWIDTH, 0);
+
+    uint64_t now = 0;
+    unsigned next_id = 0;
+    long long live_bytes = 0, max_live = 0;
+
+    for (int pi = 0; pi < nphases; pi++) {
+        const struct phase *ph = &phases[pi];
+        long long nops = ops_override ? ops_override : ph->ops;
+
+        for (long long k = 0; k < nops; k++, now++) {
+            if (heap_len > 0 && (heap[0].death <= now || live_bytes > ph->live)) {
+                struct live_block b = heap_pop();
+                emit('f', b.id, 0);
+                live_bytes -= b.size;
+            } else if (heap_len > 0 && rng_double() < ph->realloc_p) {
+                struct live_block *b = &heap[rng_next() % heap_len];
+                unsigned size;
+
+                if (ph->grow > 0) {
+                    double v = b->size * ph->grow;
+                    size = v > MAXSIZE ? MAXSIZE : (unsigned)v;
+                    if (size == 0)
+                        size = 1;
+                } else
+                    size = draw_size(ph);
+                emit('r', b->id, size);
+                live_bytes += (long long)size - b->size;
+                b->size = size;
+            } else {
+                struct live_block b;
+                double life = dist_sample(&ph->lifetime);
+
+                b.id = next_id++;
+                b.size = draw_size(ph);
+                b.death = now + 1 + (life > 0 ? (uint64_t)life : 0);
+                heap_push(b);
+                emit('a', b.id, b.size);
+                live_bytes += b.size;
+            }
+            if (live_bytes > max_live)
+                max_live = live_bytes;
+        }
+    }
+
+    /* Free everything still live so the trace is balanced */
+    while (heap_len > 0) {
+        emit('f', heap_pop().id, 0);
+        now++;
+    }
+    out_flush();
+
+    if (now > INT32_MAX || next_id == 0) {
+        fprintf(stderr, "tracegen: %s trace (%llu ops, %u ids) cannot be read by mdriver\n",
+                next_id == 0 ? "empty" : "oversized", (unsigned long long)now, next_id);
+        exit(1);
+    }
+
+    /* sugg_heapsize, num_ids, num_ops, weight */
+    rewind(out);
+    fprintf(out, "%*lld\n%*u\n%*llu\n%*d\n", HDRWIDTH, max_live, HDRWIDTH, next_id,
+            HDRWIDTH, (unsigned long long)now, HDRWIDTH, 1);
+    if (fclose(out) != 0) {
+        perror(outfile);
+        exit(1);
+    }
+    return 0;
+}